@@ -1,6 +1,131 @@
 #ifndef _ATOMIC_H_
 #define _ATOMIC_H_
+
+// Atomic counters.
+//
+// Each operation is a single lock-prefixed instruction (or a
+// cmpxchg loop), so a counter can be shared between CPUs
+// without a spin lock.  The operations that modify a counter
+// are also full memory barriers, as lock-prefixed instructions
+// are on x86.
+
 typedef struct {
-	int count;
+	volatile int count;
 } atomic_t;
+
+#define ATOMIC_INIT(i)	{ (i) }
+
+static inline int
+atomic_read(atomic_t *v)
+{
+	return v->count;
+}
+
+static inline void
+atomic_set(atomic_t *v, int i)
+{
+	v->count = i;
+}
+
+static inline void
+atomic_add(int i, atomic_t *v)
+{
+	asm volatile("lock; addl %1, %0" : "+m" (v->count) : "ir" (i) : "cc", "memory");
+}
+
+static inline void
+atomic_sub(int i, atomic_t *v)
+{
+	asm volatile("lock; subl %1, %0" : "+m" (v->count) : "ir" (i) : "cc", "memory");
+}
+
+static inline void
+atomic_inc(atomic_t *v)
+{
+	asm volatile("lock; incl %0" : "+m" (v->count) : : "cc", "memory");
+}
+
+static inline void
+atomic_dec(atomic_t *v)
+{
+	asm volatile("lock; decl %0" : "+m" (v->count) : : "cc", "memory");
+}
+
+// Subtract i from v; return true if the result is zero.
+static inline int
+atomic_sub_and_test(int i, atomic_t *v)
+{
+	unsigned char c;
+
+	asm volatile("lock; subl %2, %0; sete %1"
+		     : "+m" (v->count), "=qm" (c) : "ir" (i) : "cc", "memory");
+	return c != 0;
+}
+
+// Decrement v; return true if the result is zero.
+static inline int
+atomic_dec_and_test(atomic_t *v)
+{
+	unsigned char c;
+
+	asm volatile("lock; decl %0; sete %1"
+		     : "+m" (v->count), "=qm" (c) : : "cc", "memory");
+	return c != 0;
+}
+
+// Add i to v and return the new value.
+static inline int
+atomic_add_return(int i, atomic_t *v)
+{
+	int old = i;
+
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (old), "+m" (v->count) : : "cc", "memory");
+	return old + i;
+}
+
+#define atomic_sub_return(i, v)	atomic_add_return(-(i), (v))
+#define atomic_inc_return(v)	atomic_add_return(1, (v))
+#define atomic_dec_return(v)	atomic_add_return(-1, (v))
+
+// If v is old, set it to new.  Returns the value v had before.
+static inline int
+atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	int prev;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (prev), "+m" (v->count) : "r" (new), "0" (old)
+		     : "cc", "memory");
+	return prev;
+}
+
+static inline int
+atomic_xchg(atomic_t *v, int new)
+{
+	asm volatile("xchgl %0, %1"
+		     : "+r" (new), "+m" (v->count) : : "memory");
+	return new;
+}
+
+// Add a to v unless v is u.  Returns true if v was not u.
+static inline int
+atomic_add_unless(atomic_t *v, int a, int u)
+{
+	int c, old;
+
+	c = atomic_read(v);
+	for(;;){
+		if(c == u)
+			return 0;
+		old = atomic_cmpxchg(v, c, c + a);
+		if(old == c)
+			return 1;
+		c = old;
+	}
+}
+
+// Take a reference, unless the last one is already gone.
+#define atomic_inc_not_zero(v)	atomic_add_unless((v), 1, 0)
+
 #endif
@@ -13,9 +13,10 @@
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 // 
-// The implementation uses three state flags internally:
-// * B_BUSY: the block has been returned from bread
-//     and has not been passed back to brelse.  
+// Each buffer has a sleep lock, held from bread to brelse.
+// refcnt counts the processes that hold or are waiting for
+// it; a buffer is recycled only when nobody does.
+// The implementation uses two state flags internally:
 // * B_VALID: the buffer data has been initialized
 //     with the associated disk block contents.
 // * B_DIRTY: the buffer data has been modified
@@ -27,7 +28,7 @@
 #include "spinlock.h"
 #include "buf.h"
 
-struct buf buf[NBUF];
+struct buf *buf;   // NBUF of them, from vmalloc
 struct spinlock buf_table_lock;
 
 // Linked list of all buffers, through prev/next.
@@ -41,11 +42,14 @@ binit(void)
   struct buf *b;
 
   initlock(&buf_table_lock, "buf_table");
+  if((buf = vmalloc(NBUF * sizeof(struct buf))) == 0)
+    panic("binit");
 
   // Create linked list of buffers
   bufhead.prev = &bufhead;
   bufhead.next = &bufhead;
   for(b = buf; b < buf+NBUF; b++){
+    initsleeplock(&b->lock, "buf");
     b->next = bufhead.next;
     b->prev = &bufhead;
     bufhead.next->prev = b;
@@ -63,35 +67,32 @@ bget(uint dev, uint sector)
 
   acquire(&buf_table_lock);
 
- loop:
   // Try for cached block.
   for(b = bufhead.next; b != &bufhead; b = b->next){
-    if((b->flags & (B_BUSY|B_VALID)) &&
-       b->dev == dev && b->sector == sector){
-      if(b->flags & B_BUSY){
-        sleep(buf, &buf_table_lock);
-        goto loop;
-      }
-      b->flags |= B_BUSY;
+    if(b->dev == dev && b->sector == sector){
+      b->refcnt++;
       release(&buf_table_lock);
+      acquire_sleep(&b->lock);
       return b;
     }
   }
 
   // Allocate fresh block.
   for(b = bufhead.prev; b != &bufhead; b = b->prev){
-    if((b->flags & B_BUSY) == 0){
-      b->flags = B_BUSY;
+    if(b->refcnt == 0){
+      b->flags = 0;
       b->dev = dev;
       b->sector = sector;
+      b->refcnt = 1;
       release(&buf_table_lock);
+      acquire_sleep(&b->lock);
       return b;
     }
   }
   panic("bget: no buffers");
 }
 
-// Return a B_BUSY buf with the contents of the indicated disk sector.
+// Return a locked buf with the contents of the indicated disk sector.
 struct buf*
 bread(uint dev, uint sector)
 {
@@ -107,7 +108,7 @@ bread(uint dev, uint sector)
 void
 bwrite(struct buf *b)
 {
-  if((b->flags & B_BUSY) == 0)
+  if(!holding_sleep(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
   ide_rw(b);
@@ -117,21 +118,20 @@ bwrite(struct buf *b)
 void
 brelse(struct buf *b)
 {
-  if((b->flags & B_BUSY) == 0)
+  if(!holding_sleep(&b->lock))
     panic("brelse");
 
-  acquire(&buf_table_lock);
-
-  b->next->prev = b->prev;
-  b->prev->next = b->next;
-  b->next = bufhead.next;
-  b->prev = &bufhead;
-  bufhead.next->prev = b;
-  bufhead.next = b;
-
-  b->flags &= ~B_BUSY;
-  wakeup(buf);
+  release_sleep(&b->lock);
 
+  acquire(&buf_table_lock);
+  if(--b->refcnt == 0){
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    b->next = bufhead.next;
+    b->prev = &bufhead;
+    bufhead.next->prev = b;
+    bufhead.next = b;
+  }
   release(&buf_table_lock);
 }
 
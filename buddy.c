@@ -1,168 +1,260 @@
+// Buddy allocator for physical page frames.
+//
+// Free memory is kept in blocks of 2^order pages, for orders 0
+// to MAX_ORDER-1, each aligned to its own size in physical
+// memory.  A block's buddy, the other half of the block one
+// order up, is then found by flipping one bit of its page frame
+// number.  A bitmap per order, with a bit for every aligned block
+// of that order, says which blocks are free, so freeing tests
+// its buddy with one bit and merges as far up as it can.
+//
+// Requests for a number of pages that is not a power of two
+// take the next order up and give the tail back at once, so
+// that every allocated page can be freed on its own, or in any
+// run, later.
+//
+// kalloc.c serializes all calls with kalloc_lock.
+
 #include "buddy.h"
 #include "defs.h"
 
 free_area_t free_area[MAX_ORDER];
-struct Page * mem_map;
-const int FreeAreaSize[MAX_ORDER] = {1,2,4,8,16,32,64,128,256,512,1024};
-void test_buddy();
+static uchar * freemap[MAX_ORDER];  // Bit n: block n of the order is free
+static uint nframes;                // Frames covered by the maps
+static uint nfree;                  // Frames on the free lists
 
-// check if pointer page indicates the first page frame of a block of order_size pages
-// if so , return 1, else return 0
-int
-page_is_buddy(struct Page * page, int order)
+#define PFN(page)  ((uint)((page) - pages))
+
+static int
+testbit(int order, uint pfn)
 {
-  if (PageProperty(page) && page->property == order && !PageReserved(page))
-    return 1;
-  return 0;
+  uint n = pfn >> order;
+  return freemap[order][n >> 3] & (1 << (n & 7));
+}
+
+static void
+setbit(int order, uint pfn)
+{
+  uint n = pfn >> order;
+  freemap[order][n >> 3] |= 1 << (n & 7);
+}
+
+static void
+clearbit(int order, uint pfn)
+{
+  uint n = pfn >> order;
+  freemap[order][n >> 3] &= ~(1 << (n & 7));
+}
+
+// Bytes of bitmap needed to cover n frames.
+uint
+buddy_mapsize(uint n)
+{
+  uint size;
+  int i;
+  size = 0;
+  for (i = 0; i < MAX_ORDER; i++)
+    size += ((n >> i) + 8) / 8;
+  return size;
 }
 
+// Set up the free bitmaps for frames 0 to n-1 in map, which
+// must be buddy_mapsize(n) bytes of zeroes.  Everything starts
+// out allocated; init_memmap frees the usable memory.
 void
-init_memmap(struct Page * base, unsigned long nr)
+buddy_init(uchar * map, uint n)
 {
-  int i,order;
-  struct Page * page = base;
-  mem_map = base;
+  int i;
+  nframes = n;
   for (i = 0; i < MAX_ORDER; i++) {
-    if (!LIST_EMPTY(&(free_area[i].free_list)))
-      panic("error");
+    LIST_INIT(&free_area[i].free_list);
+    free_area[i].nr_free = 0;
+    freemap[i] = map;
+    map += ((n >> i) + 8) / 8;
   }
-  while (nr) {
-    for (order = 10; order >=0; order --) {
-      if (nr >= FreeAreaSize[order]) {
-        LIST_INSERT_HEAD(&(free_area[order].free_list), page, lru);
-        free_area[order].nr_free ++;
-        page->property = order;
-        nr -= FreeAreaSize[order];
-        page += FreeAreaSize[order];
-        break;
-      }
-    }
+}
+
+static void
+add_block(uint pfn, int order)
+{
+  LIST_INSERT_HEAD(&free_area[order].free_list, &pages[pfn], lru);
+  pages[pfn].property = order;
+  setbit(order, pfn);
+  free_area[order].nr_free ++;
+  nfree += 1 << order;
+}
+
+static void
+del_block(uint pfn, int order)
+{
+  LIST_REMOVE(&pages[pfn], lru);
+  clearbit(order, pfn);
+  free_area[order].nr_free --;
+  nfree -= 1 << order;
+}
+
+// Smallest order whose blocks hold nr pages, or MAX_ORDER.
+int
+order_for(int nr)
+{
+  int order;
+  for (order = 0; order < MAX_ORDER; order++)
+    if (nr <= (1 << order))
+      break;
+  return order;
+}
+
+// Free the block of 2^order pages at page, merging it with
+// its buddies.
+void
+free_pages_bulk(struct Page * page, int order)
+{
+  uint pfn = PFN(page), buddy;
+  while (order < MAX_ORDER - 1) {
+    buddy = pfn ^ (1 << order);
+    if (buddy + (1 << order) > nframes || !testbit(order, buddy))
+      break;
+    del_block(buddy, order);
+    pfn &= ~(1 << order);
+    order ++;
   }
-//  test_buddy();
+  dbmsg("free order %x, page %x\n", order, pfn);
+  add_block(pfn, order);
 }
 
-struct Page *
-__alloc_pages(int nr)
+// Free the nr pages at page, as the largest aligned
+// blocks that fit.
+void
+__free_pages(struct Page * page, int nr)
 {
-  int i;
-  struct Page * p;
-  for (i = 0; i < MAX_ORDER; i++) {
-    if (nr <= FreeAreaSize[i]) {
-      p = alloc_pages_bulk(i);
-      dbmsg("cpu %x kalloc %x : order %d;\n",cpu(), p - pages, i);
-      return p;
-    }
+  uint pfn = PFN(page);
+  int order;
+  while (nr > 0) {
+    for (order = MAX_ORDER - 1; order > 0; order --)
+      if (!(pfn & ((1 << order) - 1)) && (1 << order) <= nr)
+        break;
+    free_pages_bulk(&pages[pfn], order);
+    pfn += 1 << order;
+    nr -= 1 << order;
   }
-  return NULL;
 }
 
-// implement the buddy system strategy for freeing page frames
+// Give the nr pages at base, which are usable memory,
+// to the allocator.
+void
+init_memmap(struct Page * base, unsigned long nr)
+{
+  if (PFN(base) + nr > nframes)
+    panic("init_memmap");
+  __free_pages(base, nr);
+}
+
+// Take a block of 2^order pages, splitting a larger one
+// if there is none of that order.
 struct Page *
 alloc_pages_bulk(int order)
 {
-  int isalloc = 0;
-  int current_order, size = 0;
+  int current_order;
+  uint pfn;
 
-  struct Page * page = NULL, * buddy = NULL;
-
-  // try to find a suitable block in the buddy system
-  for (current_order = order; current_order < MAX_ORDER; current_order ++) {
-    if (!LIST_EMPTY(&(free_area[current_order].free_list))) {
-      isalloc = 1;
+  for (current_order = order; current_order < MAX_ORDER; current_order ++)
+    if (!LIST_EMPTY(&free_area[current_order].free_list))
       break;
-    }
-  }
-
-  if (!isalloc)
+  if (current_order == MAX_ORDER)
     return NULL;
-  else {
-    page = LIST_FIRST(&(free_area[current_order].free_list));
-//    cprintf("current order : %x,remove %x\n",current_order,page - pages);
-    LIST_REMOVE(page, lru);
-    page->property = 0;
-    ClearPageProperty(page);
-    free_area[current_order].nr_free --;
-  }
 
-  size = 1 << current_order;
+  pfn = PFN(LIST_FIRST(&free_area[current_order].free_list));
+  del_block(pfn, current_order);
   while (current_order > order) {
     current_order --;
-    size >>= 1;
-    buddy = page + size;
-//    cprintf("insert order : %x, insert %x\n",current_order, buddy - pages);
-    LIST_INSERT_HEAD(&(free_area[current_order].free_list), buddy, lru);
-    buddy->property = current_order;
-    SetPageProperty(buddy);
-    free_area[current_order].nr_free ++;
+    add_block(pfn + (1 << current_order), current_order);
   }
+  return &pages[pfn];
+}
 
-  return page;
+// Allocate nr contiguous pages.
+struct Page *
+__alloc_pages(int nr)
+{
+  struct Page * p;
+  int order;
+
+  if ((order = order_for(nr)) == MAX_ORDER)
+    return NULL;
+  if ((p = alloc_pages_bulk(order)) == NULL)
+    return NULL;
+  dbmsg("cpu %x kalloc %x : order %d;\n",cpu(), p - pages, order);
+  if (nr < (1 << order))
+    __free_pages(p + nr, (1 << order) - nr);
+  return p;
 }
 
-void
-__free_pages(struct Page * page, int nr)
+// Number of frames the allocator covers.
+uint
+buddy_frames(void)
 {
-  int i;
-  for (i = 0; i < MAX_ORDER; i++) {
-    if (nr <= FreeAreaSize[i]) {
-      dbmsg("kfree %x : order %d\n",page - pages, i);
-      free_pages_bulk(page, i);
-      return;
-    }
-  }
+  return nframes;
 }
 
-// implement the buddy system strategy for freeing page frames
-void
-free_pages_bulk(struct Page * page, int order)
+// Number of free frames.  Callers that do not hold kalloc_lock
+// get a hint.
+uint
+buddy_nr_free(void)
 {
-  int size = 1 << order;
-  unsigned long page_idx = page - mem_map, buddy_idx;
-  struct Page * buddy, * coalesced;
-  while (order < 10) {
-    // calculate the buddy index, by xor operation
-    // if 1 << order bit was previously zero, buddy 
-    // index is equal to page_idx + size, conversely,
-    // if the bit was previously one, buddy index is
-    // equal to page_idx - size
-    buddy_idx = page_idx ^ size;
-    buddy = &mem_map[buddy_idx];
-    if (!page_is_buddy(buddy, order))
+  return nfree;
+}
+
+// Order of the free block that starts at frame pfn,
+// or -1 if no free block starts there.
+int
+buddy_free_order(uint pfn)
+{
+  int order;
+  for (order = 0; order < MAX_ORDER; order++) {
+    if (pfn & ((1 << order) - 1))
       break;
-    LIST_REMOVE(buddy, lru);
-    free_area[order].nr_free --;
-    buddy->property = 0;
-    ClearPageProperty(buddy);
-    page_idx &= buddy_idx;
-    order ++;
+    if (testbit(order, pfn))
+      return order;
   }
-  coalesced = &mem_map[page_idx];
-  dbmsg("free order %x, page %x\n", order, coalesced - pages);
-  coalesced->property = order;
-  SetPageProperty(coalesced);
-  LIST_INSERT_HEAD(&(free_area[order].free_list), coalesced, lru);
-  free_area[order].nr_free ++;
+  return -1;
+}
+
+// Is frame pfn inside a free block of at least 2^order pages?
+int
+buddy_isfree(uint pfn, int order)
+{
+  for (; order < MAX_ORDER; order++)
+    if (testbit(order, pfn & ~((1 << order) - 1)))
+      return 1;
+  return 0;
 }
 
+// Take the free block of 2^order pages at frame pfn off the
+// free lists; free_pages_bulk gives it back.
 void
-print_buddy()
+buddy_take(uint pfn, int order)
 {
-  int i;
-  for (i = 0; i < MAX_ORDER; i++)
-    cprintf("buddy %d : %x blocks; ",i,free_area[i].nr_free);
-  cprintf("\n");
+  del_block(pfn, order);
 }
 
+// Print, for each order, the free blocks and the fragmentation
+// index: the share of free memory, in thousandths, that is in
+// blocks too small to satisfy a request of that order.  0 means
+// every free page could serve such a request, 1000 none.
 void
-test_buddy()
-{
-  struct Page * a1, * a2;
-  print_buddy();
-  a1 = alloc_pages_bulk(8);
-  a2 = alloc_pages_bulk(8);
-  print_buddy();
-  free_pages_bulk(a1, 8);
-  print_buddy();
-  free_pages_bulk(a2, 8);
-  print_buddy();
+print_buddy()
+{
+  uint free, usable;
+  int i, j;
+  free = 0;
+  for (i = 0; i < MAX_ORDER; i++)
+    free += free_area[i].nr_free << i;
+  cprintf("order blocks frag\n");
+  for (i = 0; i < MAX_ORDER; i++) {
+    usable = 0;
+    for (j = i; j < MAX_ORDER; j++)
+      usable += free_area[j].nr_free << j;
+    cprintf("%d %d %d\n", i, free_area[i].nr_free,
+            free ? (free - usable) * 1000 / free : 0);
+  }
 }
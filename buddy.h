@@ -2,19 +2,32 @@
 #define _BUDDY_H_
 #include "pmap.h"
 
-#define MAX_ORDER  11
+// Blocks of up to 2^(MAX_ORDER-1) pages; build with
+// -DMAX_ORDER=n to change it.
+#ifndef MAX_ORDER
+#define MAX_ORDER  13
+#endif
 
 typedef struct free_area {
 	page_list_head_t free_list;
 	unsigned long nr_free;
 } free_area_t;
 
+uint buddy_mapsize(uint n);
+void buddy_init(uchar * map, uint n);
 void init_memmap(struct Page * base, unsigned long nr);
 
-extern struct Page * mem_map;
+extern free_area_t free_area[MAX_ORDER];
 struct Page * __alloc_pages(int nr);
 void __free_pages(struct Page * page, int nr);
 struct Page * alloc_pages_bulk(int order);
 void free_pages_bulk(struct Page * page, int order);
+void print_buddy();
+int order_for(int nr);
+uint buddy_frames(void);
+uint buddy_nr_free(void);
+int buddy_free_order(uint pfn);
+int buddy_isfree(uint pfn, int order);
+void buddy_take(uint pfn, int order);
 
 #endif
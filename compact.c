@@ -0,0 +1,143 @@
+// Memory compaction.
+//
+// A multi-page kalloc (a kernel stack, say) can fail with plenty
+// of memory free, when every aligned block of the size it needs
+// holds a page or two in use.  If those pages are user pages,
+// they can be moved: compact() picks the block that needs the
+// fewest moves, takes its free pieces off the free lists so that
+// nobody allocates them meanwhile, and moves each page in use to
+// a frame elsewhere with migrate_page (pmap.c), which finds the
+// page's one mapping through the reverse map.  Giving the pieces
+// and the old frames back then merges them into a free block of
+// the size wanted.
+//
+// Only small orders are worth it: the cost of a block grows with
+// its size, and large allocations happen only at boot.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "buddy.h"
+
+#define COMPACT_MAX_ORDER 5
+
+// What compact() does with each page of the chosen block.
+#define C_FREE   0x10   // Head of a free piece; low bits: its order
+#define C_MOVE   0x20   // In use; to be moved
+#define C_MOVED  0x40   // Moved; the old frame is free to reuse
+
+extern struct spinlock kalloc_lock;
+
+static struct {
+  uint attempts;   // Calls to compact()
+  uint successes;  // ... that made a block of the order asked for
+  uint moved;      // Pages migrated
+} cstat;
+
+// Can page p be moved?  Only user pages, which the reverse
+// map knows, can.  The answer may be stale by the time
+// migrate_page runs; it checks again.
+static int
+movable(struct Page * p)
+{
+  return !PageReserved(p) && p->rmap_pgdir && IsPageMapped(p) > 0;
+}
+
+// Number of pages to move to free the 2^order block at frame
+// base, or -1 if some page in it cannot be moved.
+// Caller holds kalloc_lock.
+static int
+block_cost(uint base, int order)
+{
+  uint pfn, end;
+  int cost, k;
+
+  cost = 0;
+  end = base + (1 << order);
+  for (pfn = base; pfn < end; ) {
+    if ((k = buddy_free_order(pfn)) >= 0) {
+      pfn += 1 << k;
+      continue;
+    }
+    if (!movable(&pages[pfn]))
+      return -1;
+    cost++;
+    pfn++;
+  }
+  return cost;
+}
+
+// Try to make a free block of 2^order pages by moving user
+// pages out of the way.  Returns 1 if there is one now.
+int
+compact(int order)
+{
+  uchar state[1 << COMPACT_MAX_ORDER];
+  uint base, best, nframes;
+  int cost, bestcost, i, k, ok;
+
+  if (order <= 0 || order > COMPACT_MAX_ORDER)
+    return 0;
+
+  acquire(&kalloc_lock);
+  cstat.attempts++;
+  nframes = buddy_frames();
+  bestcost = -1;
+  best = 0;
+  for (base = 0; base + (1 << order) <= nframes; base += 1 << order) {
+    cost = block_cost(base, order);
+    if (cost == 0) {
+      // Freed by someone else since the allocation failed.
+      cstat.successes++;
+      release(&kalloc_lock);
+      return 1;
+    }
+    if (cost > 0 && (bestcost < 0 || cost < bestcost)) {
+      best = base;
+      bestcost = cost;
+    }
+  }
+  if (bestcost < 0) {
+    release(&kalloc_lock);
+    return 0;
+  }
+
+  // Isolate the free pieces of the block.
+  memset(state, 0, sizeof(state));
+  for (i = 0; i < 1 << order; ) {
+    if ((k = buddy_free_order(best + i)) >= 0) {
+      buddy_take(best + i, k);
+      state[i] = C_FREE | k;
+      i += 1 << k;
+    } else
+      state[i++] = C_MOVE;
+  }
+  release(&kalloc_lock);
+
+  for (i = 0; i < 1 << order; i++)
+    if (state[i] == C_MOVE && migrate_page(&pages[best + i]) == 0)
+      state[i] = C_MOVED;
+
+  acquire(&kalloc_lock);
+  for (i = 0; i < 1 << order; i++) {
+    if (state[i] & C_FREE)
+      free_pages_bulk(&pages[best + i], state[i] & 0xf);
+    else if (state[i] == C_MOVED) {
+      free_pages_bulk(&pages[best + i], 0);
+      cstat.moved++;
+    }
+  }
+  ok = buddy_isfree(best, order);
+  if (ok)
+    cstat.successes++;
+  release(&kalloc_lock);
+  return ok;
+}
+
+void
+compactdump(void)
+{
+  cprintf("compaction: %d attempts, %d successes, %d pages moved\n",
+          cstat.attempts, cstat.successes, cstat.moved);
+}
@@ -167,16 +167,23 @@ cprintf(char *fmt, ...)
     release(&console_lock);
 }
 
+// The user buffer is copied a chunk at a time, outside the
+// locks: touching it may fault, and the fault sleep for swap.
 int
 console_write(struct inode *ip, char *buf, int n)
 {
-  int i;
+  char chunk[128];
+  int i, j, m;
 
   iunlock(ip);
-  acquire(&console_lock);
-  for(i = 0; i < n; i++)
-    cons_putc(buf[i] & 0xff);
-  release(&console_lock);
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(chunk) ? n - i : sizeof(chunk);
+    memmove(chunk, buf + i, m);
+    acquire(&console_lock);
+    for(j = 0; j < m; j++)
+      cons_putc(chunk[j] & 0xff);
+    release(&console_lock);
+  }
   ilock(ip);
 
   return n;
@@ -204,6 +211,9 @@ console_intr(int (*getc)(void))
     case C('P'):  // Process listing.
       procdump();
       break;
+    case C('L'):  // Lock statistics.
+      lockdump();
+      break;
     case C('U'):  // Kill line.
       while(input.e != input.w &&
             input.buf[(input.e-1) % INPUT_BUF] != '\n'){
@@ -259,8 +269,10 @@ console_read(struct inode *ip, char *dst, int n)
       }
       break;
     }
+    release(&input.lock);  // dst may fault; see console_write
     *dst++ = c;
     --n;
+    acquire(&input.lock);
     if(c == '\n')
       break;
   }
@@ -276,8 +288,10 @@ console_init(void)
   initlock(&console_lock, "console");
   initlock(&input.lock, "console input");
 
+  acquire_write(&devsw_lock);
   devsw[CONSOLE].write = console_write;
   devsw[CONSOLE].read = console_read;
+  release_write(&devsw_lock);
   use_console_lock = 1;
 
   pic_enable(IRQ_KBD);
@@ -4,10 +4,18 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct Page;
+struct ktimer;
 struct pipe;
 struct proc;
+struct procmem;
+struct rcu_head;
+struct rwlock;
+struct seqlock;
+struct sleeplock;
 struct spinlock;
 struct stat;
+struct waitq;
 
 // bio.c
 void            binit(void);
@@ -15,6 +23,10 @@ struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 
+// compact.c
+int             compact(int);
+void            compactdump(void);
+
 // console.c
 void            console_init(void);
 void            cprintf(char*, ...);
@@ -63,19 +75,44 @@ void            ioapic_init(void);
 
 // kalloc.c
 char*           kalloc(int);
+char*           kalloc_nowait(int);
+void            kallocdump(void);
 void            kfree(char*, int);
+uint            kfreecount(void);
+void            kfree_list(char**, int);
 void            kinit(void);
+void            kzinit(void);
+char*           kzalloc(int);
 
 // kbd.c
 void            kbd_intr(void);
 
+// ktimer.c
+void            ktimer_add(struct ktimer*, uint);
+int             ktimer_del(struct ktimer*);
+int             ktimer_del_sync(struct ktimer*);
+void            ktimer_init(void);
+void            ktimer_run(void);
+void            ktimer_setup(struct ktimer*, void(*)(void*), void*);
+
+// kstack.c
+int             kstack_alloc(char**, pte_t**);
+uint            kstack_cached(void);
+void            kstack_free(char*, pte_t*);
+
 // lapic.c
-int             cpu(void);
+int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapic_eoi(void);
 void            lapic_init(int);
+void            lapic_ipi(uchar, int);
 void            lapic_startap(uchar, uint);
 
+// lockdep.c
+void            lockdep_acquire(struct spinlock*, int, unsigned long long);
+void            lockdep_dump(void);
+void            lockdep_release(struct spinlock*, unsigned long long);
+
 // mp.c
 extern int      ismp;
 int             mp_bcpu(void);
@@ -94,31 +131,88 @@ int             pipewrite(struct pipe*, char*, int);
 
 // proc.c
 struct proc*    copyproc(struct proc*);
-struct proc*    curproc(void);
+int             cpu(void);
 void            exit(void);
-int             growproc(int);
+int             growproc(int, int);
 int             kill(int);
+struct proc*    kthread(char*, void (*)(void));
+int             madvise(uint, uint, int);
 void            pinit(void);
 void            procdump(void);
+int             procmem(struct procmem*, int);
+int             runq_empty(void);
 void            scheduler(void) __attribute__((noreturn));
+void            setrunnable(struct proc*);
+void            seginit(void);
 void            setupsegs(struct proc*);
+uint            switchsegs(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            sleepon(struct waitq*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeone(struct waitq*);
 void            yield(void);
 int             kgrowproc(int);
-int             pgfault_handler(vaddr_t faultaddr);
+int             pgfault_handler(vaddr_t faultaddr, int user);
+
+// rcu.c
+void            call_rcu(struct rcu_head*, void (*)(struct rcu_head*));
+void            rcu_init(void);
+void            rcu_poll(void);
+void            rcu_qs(void);
+void            synchronize_rcu(void);
+
+// rmap.c
+int             rmap_add(struct Page*, pde_t*, vaddr_t);
+void            rmap_del(struct Page*, pde_t*, vaddr_t);
+void            rmap_init(void);
+void            rmap_move(struct Page*, struct Page*);
+int             rmap_walk(struct Page*, int (*)(struct Page*, pde_t*, vaddr_t, void*), void*);
+void            rmapdump(void);
+
+// rwlock.c
+void            acquire_read(struct rwlock*);
+void            acquire_write(struct rwlock*);
+void            initrwlock(struct rwlock*, char*);
+void            release_read(struct rwlock*);
+void            release_write(struct rwlock*);
+void            initseqlock(struct seqlock*, char*);
+uint            read_seqbegin(struct seqlock*);
+int             read_seqretry(struct seqlock*, uint);
+void            write_seqlock(struct seqlock*);
+void            write_sequnlock(struct seqlock*);
+
+// sleeplock.c
+void            acquire_sleep(struct sleeplock*);
+int             holding_sleep(struct sleeplock*);
+void            initsleeplock(struct sleeplock*, char*);
+void            release_sleep(struct sleeplock*);
+int             tryacquire_sleep(struct sleeplock*);
+
+// swap.c
+int             swap_alloc(void);
+void            swap_cache(int, struct Page*);
+void            swap_cancel(int);
+void            swap_free(int);
+int             swap_in(pde_t*, vaddr_t, pte_t);
+void            swap_writepage(int, struct Page*);
+void            swapdump(void);
+void            swapinit(void);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
+void            swtchvm(struct context*, struct context*, uint);
 
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+int             lockclass(struct spinlock*);
+void            lockdump(void);
 void            release(struct spinlock*);
+int             tryacquire(struct spinlock*);
 void            pushcli();
 void            popcli();
 
@@ -142,12 +236,34 @@ void            syscall(void);
 // timer.c
 void            timer_init(void);
 
+// tlb.c
+void            tlb_init(void);
+void            tlb_invalidate(pde_t*, vaddr_t, vaddr_t);
+void            tlb_ipi(void);
+void            tlb_release(pde_t*);
+
 // trap.c
 void            idtinit(void);
 extern int      ticks;
 void            tvinit(void);
 extern struct spinlock tickslock;
 
+// vmalloc.c
+void            vfree(void*);
+void*           vmalloc(uint);
+void            vmallocdump(void);
+void            vmalloc_init(void);
+
+// vmscan.c
+void            kswapinit(void);
+void            lru_add(struct Page*);
+void            lru_del(struct Page*);
+void            lru_init(void);
+void            lru_replace(struct Page*, struct Page*);
+int             reclaim(int);
+void            vmscandump(void);
+void            wakeup_kswapd(void);
+
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
 #ifdef DEBUG
@@ -4,5 +4,6 @@ struct devsw {
 };
 
 extern struct devsw devsw[];
+extern struct rwlock devsw_lock;
 
 #define CONSOLE 1
@@ -3,9 +3,11 @@
 #include "param.h"
 #include "file.h"
 #include "spinlock.h"
+#include "rwlock.h"
 #include "dev.h"
 
 struct devsw devsw[NDEV];
+struct rwlock devsw_lock;
 struct spinlock file_table_lock;
 struct file file[NFILE];
 
@@ -13,6 +15,7 @@ void
 fileinit(void)
 {
   initlock(&file_table_lock, "file_table");
+  initrwlock(&devsw_lock, "devsw");
 }
 
 // Allocate a file structure.
@@ -25,7 +28,7 @@ filealloc(void)
   for(i = 0; i < NFILE; i++){
     if(file[i].type == FD_CLOSED){
       file[i].type = FD_NONE;
-      file[i].ref = 1;
+      atomic_set(&file[i].ref, 1);
       release(&file_table_lock);
       return file + i;
     }
@@ -35,14 +38,14 @@ filealloc(void)
 }
 
 // Increment ref count for file f.
+// The caller holds a reference, so the count cannot
+// drop to zero underneath us and no lock is needed.
 struct file*
 filedup(struct file *f)
 {
-  acquire(&file_table_lock);
-  if(f->ref < 1 || f->type == FD_CLOSED)
+  if(atomic_read(&f->ref) < 1 || f->type == FD_CLOSED)
     panic("filedup");
-  f->ref++;
-  release(&file_table_lock);
+  atomic_inc(&f->ref);
   return f;
 }
 
@@ -52,15 +55,15 @@ fileclose(struct file *f)
 {
   struct file ff;
 
-  acquire(&file_table_lock);
-  if(f->ref < 1 || f->type == FD_CLOSED)
+  if(atomic_read(&f->ref) < 1 || f->type == FD_CLOSED)
     panic("fileclose");
-  if(--f->ref > 0){
-    release(&file_table_lock);
+  if(!atomic_dec_and_test(&f->ref))
     return;
-  }
+
+  // Last reference: nobody else can see f any more,
+  // but filealloc scans the table under the lock.
+  acquire(&file_table_lock);
   ff = *f;
-  f->ref = 0;
   f->type = FD_CLOSED;
   release(&file_table_lock);
   
@@ -1,6 +1,8 @@
+#include "atomic.h"
+
 struct file {
   enum { FD_CLOSED, FD_NONE, FD_PIPE, FD_INODE } type;
-  int ref; // reference count
+  atomic_t ref; // reference count
   char readable;
   char writable;
   struct pipe *pipe;
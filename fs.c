@@ -15,8 +15,10 @@
 #include "param.h"
 #include "stat.h"
 #include "mmu.h"
+#include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "rwlock.h"
 #include "buf.h"
 #include "fs.h"
 #include "fsvar.h"
@@ -25,15 +27,40 @@
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
 
+// The super block does not change once the file system is
+// made, so keep a copy of the last one read in memory.
+// Readers copy it out under a seqlock and never serialize.
+static struct {
+  struct seqlock lock;
+  int dev;                 // Device sb came from, 0 if none
+  struct superblock sb;
+} sbcache;
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
 {
   struct buf *bp;
-  
+  uint seq;
+  int hit;
+
+  do {
+    seq = read_seqbegin(&sbcache.lock);
+    hit = sbcache.dev == dev;
+    if(hit)
+      memmove(sb, &sbcache.sb, sizeof(*sb));
+  } while(read_seqretry(&sbcache.lock, seq));
+  if(hit)
+    return;
+
   bp = bread(dev, 1);
   memmove(sb, bp->data, sizeof(*sb));
   brelse(bp);
+
+  write_seqlock(&sbcache.lock);
+  memmove(&sbcache.sb, sb, sizeof(*sb));
+  sbcache.dev = dev;
+  write_sequnlock(&sbcache.lock);
 }
 
 // Zero a block.
@@ -115,11 +142,9 @@ bfree(int dev, uint b)
 // It is an error to use an inode without holding a reference to it.
 //
 // Processes are only allowed to read and write inode
-// metadata and contents when holding the inode's lock,
-// represented by the I_BUSY flag in the in-memory copy.
+// metadata and contents when holding the inode's lock.
 // Because inode locks are held during disk accesses, 
-// they are implemented using a flag rather than with
-// spin locks.  Callers are responsible for locking
+// they are sleep locks rather than spin locks.  Callers are responsible for locking
 // inodes before passing them to routines in this file; leaving
 // this responsibility with the caller makes it possible for them
 // to create arbitrarily-sized atomic operations.
@@ -138,7 +163,12 @@ struct {
 void
 iinit(void)
 {
+  struct inode *ip;
+
   initlock(&icache.lock, "icache.lock");
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++)
+    initsleeplock(&ip->lock, "inode");
+  initseqlock(&sbcache.lock, "sbcache");
 }
 
 // Find the inode with number inum on device dev
@@ -148,17 +178,32 @@ iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
 
+  // Look for a cached inode without the lock.  The inode
+  // slots are never freed, only reused for another inode
+  // once nobody holds a reference, so take a reference
+  // first and then make sure the slot still holds the
+  // inode we wanted.
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    if(ip->dev == dev && ip->inum == inum &&
+       atomic_inc_not_zero(&ip->ref)){
+      if(ip->dev == dev && ip->inum == inum)
+        return ip;
+      iput(ip);
+      break;
+    }
+  }
+
   acquire(&icache.lock);
 
   // Try for cached inode.
   empty = 0;
   for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+    if(atomic_read(&ip->ref) > 0 && ip->dev == dev && ip->inum == inum){
+      atomic_inc(&ip->ref);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
+    if(empty == 0 && atomic_read(&ip->ref) == 0)    // Remember empty slot.
       empty = ip;
   }
 
@@ -166,11 +211,14 @@ iget(uint dev, uint inum)
   if(empty == 0)
     panic("iget: no inodes");
 
+  // Set up the slot before publishing the reference
+  // that lockless lookups test.
   ip = empty;
   ip->dev = dev;
   ip->inum = inum;
-  ip->ref = 1;
   ip->flags = 0;
+  barrier();
+  atomic_set(&ip->ref, 1);
   release(&icache.lock);
 
   return ip;
@@ -178,12 +226,12 @@ iget(uint dev, uint inum)
 
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
+// The caller holds a reference, so iget cannot be
+// recycling ip and the cache lock is not needed.
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
-  ip->ref++;
-  release(&icache.lock);
+  atomic_inc(&ip->ref);
   return ip;
 }
 
@@ -194,14 +242,10 @@ ilock(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
-  if(ip == 0 || ip->ref < 1)
+  if(ip == 0 || atomic_read(&ip->ref) < 1)
     panic("ilock");
 
-  acquire(&icache.lock);
-  while(ip->flags & I_BUSY)
-    sleep(ip, &icache.lock);
-  ip->flags |= I_BUSY;
-  release(&icache.lock);
+  acquire_sleep(&ip->lock);
 
   if(!(ip->flags & I_VALID)){
     bp = bread(ip->dev, IBLOCK(ip->inum));
@@ -223,34 +267,36 @@ ilock(struct inode *ip)
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1)
+  if(ip == 0 || !holding_sleep(&ip->lock) || atomic_read(&ip->ref) < 1)
     panic("iunlock");
 
-  acquire(&icache.lock);
-  ip->flags &= ~I_BUSY;
-  wakeup(ip);
-  release(&icache.lock);
+  release_sleep(&ip->lock);
 }
 
 // Caller holds reference to unlocked ip.  Drop reference.
 void
 iput(struct inode *ip)
 {
+  // Dropping any but the last reference needs no lock:
+  // the count stays above zero, so iget leaves ip alone.
+  if(atomic_add_unless(&ip->ref, -1, 1))
+    return;
+
   acquire(&icache.lock);
-  if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
+  if(atomic_read(&ip->ref) == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
     // inode is no longer used: truncate and free inode.
-    if(ip->flags & I_BUSY)
+    // Nobody else has a reference, so nobody can hold the
+    // lock and taking it cannot sleep.
+    if(!tryacquire_sleep(&ip->lock))
       panic("iput busy");
-    ip->flags |= I_BUSY;
     release(&icache.lock);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
+    release_sleep(&ip->lock);
     acquire(&icache.lock);
-    ip->flags &= ~I_BUSY;
-    wakeup(ip);
   }
-  ip->ref--;
+  atomic_dec(&ip->ref);
   release(&icache.lock);
 }
 
@@ -403,11 +449,17 @@ readi(struct inode *ip, char *dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  int (*read)(struct inode*, char*, int);
 
   if(ip->type == T_DEV){
-    if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
+    if(ip->major < 0 || ip->major >= NDEV)
       return -1;
-    return devsw[ip->major].read(ip, dst, n);
+    acquire_read(&devsw_lock);
+    read = devsw[ip->major].read;
+    release_read(&devsw_lock);
+    if(!read)
+      return -1;
+    return read(ip, dst, n);
   }
 
   if(off > ip->size || off + n < off)
@@ -430,11 +482,17 @@ writei(struct inode *ip, char *src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  int (*write)(struct inode*, char*, int);
 
   if(ip->type == T_DEV){
-    if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
+    if(ip->major < 0 || ip->major >= NDEV)
+      return -1;
+    acquire_read(&devsw_lock);
+    write = devsw[ip->major].write;
+    release_read(&devsw_lock);
+    if(!write)
       return -1;
-    return devsw[ip->major].write(ip, src, n);
+    return write(ip, src, n);
   }
 
   if(off + n < off)
@@ -1,10 +1,14 @@
 // in-core file system types
 
+#include "atomic.h"
+#include "sleeplock.h"
+
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
-  int ref;            // Reference count
-  int flags;          // I_BUSY, I_VALID
+  atomic_t ref;       // Reference count
+  struct sleeplock lock; // Held while reading or writing the inode
+  int flags;          // I_VALID
 
   short type;         // copy of disk inode
   short major;
@@ -14,5 +18,4 @@ struct inode {
   uint addrs[NADDRS];
 };
 
-#define I_BUSY 0x1
 #define I_VALID 0x2
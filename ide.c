@@ -9,6 +9,7 @@
 #include "traps.h"
 #include "spinlock.h"
 #include "buf.h"
+#include "ktimer.h"
 
 #define IDE_BSY       0x80
 #define IDE_DRDY      0x40
@@ -18,6 +19,8 @@
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
 
+#define IDE_TIMEOUT   300   // ticks to wait for a disk interrupt
+
 // ide_queue points to the buf now being read/written to the disk.
 // ide_queue->qnext points to the next buf to be processed.
 // You must hold ide_lock while manipulating queue.
@@ -28,6 +31,12 @@ static struct buf *ide_queue;
 static int disk_1_present;
 static void ide_start_request();
 
+// ide_timer fires if the request at the head of ide_queue
+// has not completed by ide_deadline.
+static struct ktimer ide_timer;
+static uint ide_deadline;
+static void ide_timeout(void*);
+
 // Wait for IDE disk to become ready.
 static int
 ide_wait_ready(int check_error)
@@ -47,6 +56,7 @@ ide_init(void)
   int i;
 
   initlock(&ide_lock, "ide");
+  ktimer_setup(&ide_timer, ide_timeout, 0);
   pic_enable(IRQ_IDE);
   ioapic_enable(IRQ_IDE, ncpu - 1);
   ide_wait_ready(0);
@@ -84,6 +94,21 @@ ide_start_request(struct buf *b)
   } else {
     outb(0x1f7, IDE_CMD_READ);
   }
+  ide_deadline = ticks + IDE_TIMEOUT;
+  ktimer_add(&ide_timer, ide_deadline);
+}
+
+// The disk never interrupted for the request at the
+// head of the queue: assume it was lost and reissue it.
+static void
+ide_timeout(void *arg)
+{
+  acquire(&ide_lock);
+  if(ide_queue && (int)(ticks - ide_deadline) >= 0){
+    cprintf("ide: timeout on sector %d, retrying\n", ide_queue->sector);
+    ide_start_request(ide_queue);
+  }
+  release(&ide_lock);
 }
 
 // Interrupt handler.
@@ -110,6 +135,8 @@ ide_intr(void)
   // Start disk on next buf in queue.
   if((ide_queue = b->qnext) != 0)
     ide_start_request(ide_queue);
+  else
+    ktimer_del(&ide_timer);
 
   release(&ide_lock);
 }
@@ -122,8 +149,8 @@ ide_rw(struct buf *b)
 {
   struct buf **pp;
 
-  if(!(b->flags & B_BUSY))
-    panic("ide_rw: buf not busy");
+  if(!holding_sleep(&b->lock))
+    panic("ide_rw: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
     panic("ide_rw: nothing to do");
   if(b->dev != 0 && !disk_1_present)
@@ -15,6 +15,26 @@
 
 struct spinlock kalloc_lock;
 
+// Pages zeroed ahead of time by the zeroer kernel thread, so
+// that kzalloc(PAGE) need not clear one while a process waits.
+// The thread fills the pool while the CPU has nothing better to
+// do, and sleeps once it holds ZPOOL_MAX pages until takers
+// bring it below ZPOOL_LOW.  Pooled pages are linked through
+// their Page descriptors, which leaves the pages all zero.
+#define ZPOOL_MAX  64
+#define ZPOOL_LOW  32
+
+static struct {
+  struct spinlock lock;
+  page_list_head_t pages;
+  uint n;           // Pages in the pool
+  uint zeroing;     // Pages taken from the allocator, being zeroed;
+                    // only the zeroer changes it (see there)
+  int sleeping;     // Zeroer is asleep
+  uint hits;        // kzalloc(PAGE) calls served from the pool
+  uint misses;      // ... that had to zero a page themselves
+} zpool;
+
 struct run {
   struct run *next;
   int len; // bytes
@@ -43,14 +63,19 @@ void
 init_phypages(void)
 {
   int i;
-  uint len;
+  uint len, mapsize;
   paddr_t base;
+  long long top;
   npages = 0;
   e820_memmap = (struct e820map *)(0x8000);
 
+  // pages[] is indexed by page frame number, so it must reach
+  // the end of the highest range below the I/O window, holes
+  // and all.
   for (i = 0; i < e820_memmap->nr_map; i ++) {
-  //  if (e820_memmap->map[i].type == E820_ARM)
-      npages += e820_memmap->map[i].size / PAGE;
+    top = e820_memmap->map[i].addr + e820_memmap->map[i].size;
+    if (top <= 0xfec00000 && top / PAGE > npages)
+      npages = top / PAGE;
   }
   
   cprintf("total available memory pages : %x\n", npages);
@@ -58,6 +83,12 @@ init_phypages(void)
   pages = (struct Page *)start;
   memset(pages, 0, sizeof(struct Page) * npages);
   start += ROUNDUP(sizeof(struct Page) * npages, PAGE);
+
+  // the buddy allocator's free bitmaps
+  mapsize = buddy_mapsize(npages);
+  memset(start, 0, mapsize);
+  buddy_init((uchar *)start, npages);
+  start += ROUNDUP(mapsize, PAGE);
   cprintf("start %x\n",(uint)start);
 
   for (i = 0; i < e820_memmap->nr_map; i++) {
@@ -109,6 +140,8 @@ kinit(void)
   //int i;
 
   initlock(&kalloc_lock, "kalloc");
+  initlock(&zpool.lock, "zpool");
+  LIST_INIT(&zpool.pages);
   start = (char*) &end;
   start = (char*) (((uint)start + PAGE) & ~(PAGE-1));
 //  mem = 256; // assume computer has 256 pages of RAM
@@ -158,14 +191,44 @@ kfree(char *v, int len)
   if (len <= 0 || len % PAGE)
     panic("kfree");
   nr = len / PAGE;
-  if (nr > 1024)
-    panic("kree : exceed maximum pages that kfree can handle\n");
   acquire(&kalloc_lock);
 //  cprintf("free %x\n", (uint)v);
   __free_pages(page_frame(v), nr);
   release(&kalloc_lock);
 }
 
+// Free the n single pages in v[], taking the allocator
+// lock once for all of them.
+void
+kfree_list(char **v, int n)
+{
+  int i;
+  if (n <= 0)
+    return;
+  acquire(&kalloc_lock);
+  for (i = 0; i < n; i++)
+    __free_pages(page_frame(v[i]), 1);
+  release(&kalloc_lock);
+}
+
+// Number of free pages: those on the buddy free lists, plus
+// those in the zeroed pool or on their way there.  Holding
+// zpool.lock keeps pages from moving between the two meanwhile.
+uint
+kfreecount(void)
+{
+  uint n;
+  int i;
+  acquire(&zpool.lock);
+  acquire(&kalloc_lock);
+  n = zpool.n + zpool.zeroing;
+  for (i = 0; i < MAX_ORDER; i++)
+    n += free_area[i].nr_free << i;
+  release(&kalloc_lock);
+  release(&zpool.lock);
+  return n;
+}
+
 /*
 void
 kfree(char *v, int len)
@@ -210,6 +273,41 @@ kfree(char *v, int len)
   release(&kalloc_lock);
 }*/
 
+// Allocate n bytes only if a free block of that size is at
+// hand: unlike kalloc, never drain the zeroed pool, compact,
+// or wake kswapd.  For callers that can make do with less.
+char *
+kalloc_nowait(int n)
+{
+  struct Page * p;
+  if (n <= 0 || n % PAGE || n / PAGE > 1 << (MAX_ORDER - 1))
+    panic("kalloc_nowait");
+  acquire(&kalloc_lock);
+  p = __alloc_pages(n / PAGE);
+  release(&kalloc_lock);
+  return p ? (char *)page_addr(p) : 0;
+}
+
+// Give the zeroed pool's pages back to the buddy lists, for a
+// kalloc that found nothing free.  Returns how many there were.
+static int
+zpool_drain(void)
+{
+  struct Page * p;
+  int n;
+
+  acquire(&zpool.lock);
+  acquire(&kalloc_lock);
+  for (n = 0; (p = LIST_FIRST(&zpool.pages)) != 0; n++) {
+    LIST_REMOVE(p, lru);
+    __free_pages(p, 1);
+  }
+  zpool.n = 0;
+  release(&kalloc_lock);
+  release(&zpool.lock);
+  return n;
+}
+
 // Allocate n bytes of physical memory.
 // Returns a kernel-segment pointer.
 // Returns 0 if the memory cannot be allocated.
@@ -221,12 +319,26 @@ kalloc(int n)
   if (n <= 0 || n % PAGE)
     panic("kalloc");
   nr = n / PAGE;
-  if (nr > 1024)
+  if (nr > 1 << (MAX_ORDER - 1))
     panic("kalloc : exceed maximum pages that kalloc can handle\n");
   acquire(&kalloc_lock);
   p = __alloc_pages(nr);
 //  cprintf("alloc : %x\n",page_addr(p));
   release(&kalloc_lock);
+  // Pages in the zeroed pool are free too.
+  if (p == NULL && zpool_drain() > 0) {
+    acquire(&kalloc_lock);
+    p = __alloc_pages(nr);
+    release(&kalloc_lock);
+  }
+  // Short of contiguous memory: move user pages
+  // aside to make some, and try once more.
+  if (p == NULL && nr > 1 && compact(order_for(nr))) {
+    acquire(&kalloc_lock);
+    p = __alloc_pages(nr);
+    release(&kalloc_lock);
+  }
+  wakeup_kswapd();
   if (p)
     return (char *)page_addr(p);
   else {
@@ -234,6 +346,109 @@ kalloc(int n)
     return 0;
   }
 }
+// Allocate n bytes of zeroed memory.  A single page
+// comes from the zeroed pool when it has one.
+char *
+kzalloc(int n)
+{
+  struct Page * p;
+  char * v;
+  int wake;
+
+  if (n == PAGE) {
+    acquire(&zpool.lock);
+    p = LIST_FIRST(&zpool.pages);
+    if (p) {
+      LIST_REMOVE(p, lru);
+      zpool.n--;
+      zpool.hits++;
+    } else
+      zpool.misses++;
+    wake = zpool.sleeping && zpool.n < ZPOOL_LOW;
+    if (wake)
+      zpool.sleeping = 0;
+    release(&zpool.lock);
+    if (wake)
+      wakeup(&zpool);
+    if (p)
+      return (char *)page_addr(p);
+  }
+  if ((v = kalloc(n)) != 0)
+    memset(v, 0, n);
+  return v;
+}
+
+// The zeroer kernel thread: keep the zeroed pool full,
+// but only while no process wants the CPU.
+static void
+zeroer(void)
+{
+  struct Page * p;
+  char * v;
+
+  acquire(&zpool.lock);
+  for (;;) {
+    if (zpool.n >= ZPOOL_MAX) {
+      zpool.sleeping = 1;
+      sleep(&zpool, &zpool.lock);
+      continue;
+    }
+    if (!runq_empty()) {
+      release(&zpool.lock);
+      yield();
+      acquire(&zpool.lock);
+      continue;
+    }
+    // Take the page straight from the buddy lists, not with
+    // kalloc, which may compact or wake kswapd, and not under
+    // zpool.lock.  Counting it in zeroing under kalloc_lock
+    // keeps kfreecount, which holds both locks, from missing it.
+    release(&zpool.lock);
+    acquire(&kalloc_lock);
+    if ((p = __alloc_pages(1)) != 0)
+      zpool.zeroing++;
+    release(&kalloc_lock);
+    acquire(&zpool.lock);
+    if (p == 0) {
+      zpool.sleeping = 1;
+      sleep(&zpool, &zpool.lock);
+      continue;
+    }
+    release(&zpool.lock);
+    v = (char *)page_addr(p);
+    memset(v, 0, PAGE);
+    acquire(&zpool.lock);
+    zpool.zeroing--;
+    LIST_INSERT_HEAD(&zpool.pages, p, lru);
+    zpool.n++;
+  }
+}
+
+// Start the zeroer.
+void
+kzinit(void)
+{
+  kthread("zeroer", zeroer);
+}
+
+// Print the zeroed pool's statistics, the buddy allocator's
+// free blocks and fragmentation, compaction's counters, the
+// reverse map's size, and what reclaim and swap have done.
+void
+kallocdump(void)
+{
+  cprintf("zeroed pages: %d pooled, %d hits, %d misses\n",
+          zpool.n, zpool.hits, zpool.misses);
+  acquire(&kalloc_lock);
+  print_buddy();
+  release(&kalloc_lock);
+  compactdump();
+  rmapdump();
+  vmscandump();
+  swapdump();
+  vmallocdump();
+}
+
 /*
 char*
 kalloc(int n)
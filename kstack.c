@@ -0,0 +1,101 @@
+// Kernel stacks.
+//
+// Every process's kernel stack sits at the same virtual address,
+// just below KSTACKTOP, in a page table of its own that maps
+// nothing else; a new process gets it by pointing one entry of
+// its page directory at that page table.  The page below the
+// stack is left unmapped, so running off the bottom of the stack
+// faults instead of scribbling over whatever is below.
+//
+// Stacks, with their page tables, are recycled through small
+// per-CPU caches, so that fork usually takes a stack ready to
+// use, instead of making an 8-page buddy allocation and mapping
+// it.  Stacks are zeroed on the way into the cache, off the
+// fork path.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "x86.h"
+#include "proc.h"
+#include "pmap.h"
+#include "memlayout.h"
+
+#define NKSTACKCACHE 4   // Stacks kept per CPU
+
+static struct {
+  struct {
+    char *mem;           // The stack (kernel address)
+    pte_t *pt;           // Page table mapping it
+  } s[NKSTACKCACHE];
+  int n;
+} kcache[NCPU];
+
+// Get a zeroed kernel stack, and a page table that maps it
+// at KSTACKTOP - KSTACKSIZE.  Returns 0 if out of memory.
+int
+kstack_alloc(char **mem, pte_t **pt)
+{
+  int c, i;
+
+  pushcli();
+  c = cpu();
+  if(kcache[c].n > 0){
+    kcache[c].n--;
+    *mem = kcache[c].s[kcache[c].n].mem;
+    *pt = kcache[c].s[kcache[c].n].pt;
+    popcli();
+    return 1;
+  }
+  popcli();
+
+  if((*mem = kalloc(KSTACKSIZE)) == 0)
+    return 0;
+  if((*pt = (pte_t*)alloc_page()) == 0){
+    kfree(*mem, KSTACKSIZE);
+    return 0;
+  }
+  memset(*mem, 0, KSTACKSIZE);
+  // The rest of the table, including the guard page
+  // at KSTACKTOP - KSTACKSIZE - PAGE, stays unmapped.
+  memset(*pt, 0, PAGE);
+  for(i = 0; i < KSTACKSIZE; i += PAGE)
+    (*pt)[PTX(KSTACKTOP - KSTACKSIZE + i)] = (uint)(*mem + i) | PTE_P | PTE_W;
+  return 1;
+}
+
+// Give back a stack from kstack_alloc.  No process may be
+// running on it any more.
+void
+kstack_free(char *mem, pte_t *pt)
+{
+  int c;
+
+  memset(mem, 0, KSTACKSIZE);
+  pushcli();
+  c = cpu();
+  if(kcache[c].n < NKSTACKCACHE){
+    kcache[c].s[kcache[c].n].mem = mem;
+    kcache[c].s[kcache[c].n].pt = pt;
+    kcache[c].n++;
+    popcli();
+    return;
+  }
+  popcli();
+  kfree(mem, KSTACKSIZE);
+  kfree((char*)pt, PAGE);
+}
+
+// Pages held by the caches, which are as good as free.
+uint
+kstack_cached(void)
+{
+  uint n;
+  int c;
+
+  n = 0;
+  for(c = 0; c < NCPU; c++)
+    n += kcache[c].n;
+  return n * (KSTACKSIZE/PAGE + 1);
+}
@@ -0,0 +1,223 @@
+// Kernel timers, kept in per-CPU hierarchical timing wheels.
+//
+// Each CPU owns a wheel.  ktimer_add() drops a timer into a
+// bucket chosen by how far in the future it expires: timers due
+// within TVR_SIZE ticks go into the innermost level, which has
+// one bucket per tick; later timers go into coarser outer levels.
+// The timer interrupt on each CPU calls ktimer_run(), which
+// advances the wheel one tick at a time up to the global ticks
+// counter.  Whenever the innermost level wraps, the next bucket
+// of the level above is cascaded inward, so a timer is touched
+// at most once per level before it fires.
+//
+// Insertion and cancellation are O(1), and a tick with no timers
+// due costs only a few instructions.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "ktimer.h"
+
+struct timerwheel {
+  struct spinlock lock;
+  uint clk;                         // Next tick to process
+  ktimer_list_t tv1[TVR_SIZE];
+  ktimer_list_t tvn[TVN_LEVELS][TVN_SIZE];
+};
+
+static struct timerwheel wheels[NCPU];
+
+// Bucket index of level n that the wheel's clock is in.
+#define INDEX(w, n) (((w)->clk >> (TVR_BITS + (n)*TVN_BITS)) & TVN_MASK)
+
+void
+ktimer_init(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    initlock(&wheels[i].lock, "timerwheel");
+    wheels[i].clk = ticks;
+  }
+}
+
+// Prepare t to call func(arg) when it fires.
+void
+ktimer_setup(struct ktimer *t, void (*func)(void*), void *arg)
+{
+  t->link.le_next = 0;
+  t->link.le_prev = 0;
+  t->expires = 0;
+  t->func = func;
+  t->arg = arg;
+  t->base = 0;
+  atomic_set(&t->running, 0);
+}
+
+// Put t in the bucket of w that matches its expiry.
+// Caller must hold w->lock.
+static void
+enqueue(struct timerwheel *w, struct ktimer *t)
+{
+  uint idx;
+  int n;
+  ktimer_list_t *vec;
+
+  idx = t->expires - w->clk;
+  if((int)idx < 0){
+    // Already due: fire on the next tick processed.
+    vec = &w->tv1[w->clk & TVR_MASK];
+  } else if(idx < TVR_SIZE){
+    vec = &w->tv1[t->expires & TVR_MASK];
+  } else {
+    for(n = 0; n < TVN_LEVELS-1; n++)
+      if(idx < 1 << (TVR_BITS + (n+1)*TVN_BITS))
+        break;
+    vec = &w->tvn[n][(t->expires >> (TVR_BITS + n*TVN_BITS)) & TVN_MASK];
+  }
+  LIST_INSERT_HEAD(vec, t, link);
+}
+
+// Move all timers out of bucket head onto list.
+static void
+detach(ktimer_list_t *head, ktimer_list_t *list)
+{
+  struct ktimer *t;
+
+  LIST_INIT(list);
+  while((t = LIST_FIRST(head)) != 0){
+    LIST_REMOVE(t, link);
+    LIST_INSERT_HEAD(list, t, link);
+  }
+}
+
+// Re-file the timers of bucket index of outer level n;
+// they all land in finer levels.  Returns index, so that
+// the caller can tell whether level n wrapped as well.
+static int
+cascade(struct timerwheel *w, int n, int index)
+{
+  ktimer_list_t list;
+  struct ktimer *t;
+
+  detach(&w->tvn[n][index], &list);
+  while((t = LIST_FIRST(&list)) != 0){
+    LIST_REMOVE(t, link);
+    enqueue(w, t);
+  }
+  return index;
+}
+
+// Lock the wheel t was last added to.
+// Returns 0 if t has never been added.
+static struct timerwheel*
+lockbase(struct ktimer *t)
+{
+  struct timerwheel *w;
+
+  for(;;){
+    if((w = t->base) == 0)
+      return 0;
+    acquire(&w->lock);
+    if(t->base == w)
+      return w;
+    // Moved to another CPU's wheel meanwhile; try again.
+    release(&w->lock);
+  }
+}
+
+// Arm t to fire at tick expires, on this CPU.
+// If t is already pending it is moved to the new expiry.
+void
+ktimer_add(struct ktimer *t, uint expires)
+{
+  struct timerwheel *w;
+
+  ktimer_del(t);
+  pushcli();
+  w = &wheels[cpu()];
+  acquire(&w->lock);
+  t->expires = expires;
+  t->base = w;
+  enqueue(w, t);
+  release(&w->lock);
+  popcli();
+}
+
+// Cancel t.  Returns 1 if t was pending, 0 if it had
+// already fired or was never armed.  The callback may still
+// be running on another CPU; see ktimer_del_sync.
+int
+ktimer_del(struct ktimer *t)
+{
+  struct timerwheel *w;
+  int pending;
+
+  if((w = lockbase(t)) == 0)
+    return 0;
+  pending = ktimer_pending(t);
+  if(pending){
+    LIST_REMOVE(t, link);
+    t->link.le_prev = 0;
+  }
+  release(&w->lock);
+  return pending;
+}
+
+// Cancel t and wait for a running callback to finish,
+// so that the caller may free t.  Must not be called
+// holding a lock that the callback acquires.  The count is
+// in t, not the wheel: if the callback re-armed t on another
+// CPU, t->base has moved on while the old wheel still runs it,
+// and t may even fire there before the first run is over.
+int
+ktimer_del_sync(struct ktimer *t)
+{
+  int pending;
+
+  pending = ktimer_del(t);
+  while(atomic_read(&t->running))
+    pause();
+  return pending;
+}
+
+// Fire the timers that are due on this CPU's wheel.
+// Called from the timer interrupt on every CPU.
+void
+ktimer_run(void)
+{
+  struct timerwheel *w;
+  struct ktimer *t;
+  ktimer_list_t work;
+  int index, n;
+
+  w = &wheels[cpu()];
+  acquire(&w->lock);
+  while((int)(ticks - w->clk) >= 0){
+    index = w->clk & TVR_MASK;
+    if(index == 0){
+      for(n = 0; n < TVN_LEVELS; n++)
+        if(cascade(w, n, INDEX(w, n)) != 0)
+          break;
+    }
+    w->clk++;
+
+    // Detach the bucket so that callbacks re-arming
+    // their timer cannot make this loop run forever.
+    detach(&w->tv1[index], &work);
+    while((t = LIST_FIRST(&work)) != 0){
+      LIST_REMOVE(t, link);
+      t->link.le_prev = 0;
+      // Counted before w->lock is let go, so that a
+      // ktimer_del_sync that finds t idle also finds it running.
+      atomic_inc(&t->running);
+      release(&w->lock);
+      t->func(t->arg);
+      atomic_dec(&t->running);
+      acquire(&w->lock);
+    }
+  }
+  release(&w->lock);
+}
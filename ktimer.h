@@ -0,0 +1,40 @@
+#ifndef _KTIMER_H_
+#define _KTIMER_H_
+#include "queue.h"
+#include "atomic.h"
+
+// Kernel timers.
+//
+// A ktimer calls func(arg) once, from the timer interrupt of the
+// CPU that armed it, at the first tick >= expires.  Timers are kept
+// in a per-CPU hierarchical timing wheel, so arming and cancelling
+// a timer cost O(1) no matter how many timers are pending.
+// Callbacks run with interrupts off and no timer locks held, so they
+// may acquire locks and re-arm timers, but must not sleep.
+
+typedef LIST_HEAD(ktimer_list, ktimer) ktimer_list_t;
+
+struct ktimer {
+  LIST_ENTRY(ktimer) link;    // Bucket in the wheel; le_prev == 0 if idle
+  uint expires;               // Tick at which to fire
+  void (*func)(void*);        // Callback
+  void *arg;                  // Argument passed to func
+  struct timerwheel *base;    // Wheel the timer was last added to
+  atomic_t running;           // Callbacks running, on any wheel
+};
+
+// The innermost level has 256 one-tick buckets; each of the
+// four outer levels has 64 buckets, each covering 64 times
+// the span of a bucket one level in.  Together they cover
+// the full 32-bit range of ticks.
+#define TVR_BITS  8
+#define TVN_BITS  6
+#define TVR_SIZE  (1 << TVR_BITS)
+#define TVN_SIZE  (1 << TVN_BITS)
+#define TVR_MASK  (TVR_SIZE - 1)
+#define TVN_MASK  (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+#define ktimer_pending(t) ((t)->link.le_prev != 0)
+
+#endif
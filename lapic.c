@@ -91,7 +91,7 @@ lapic_init(int c)
 }
 
 int
-cpu(void)
+lapicid(void)
 {
   // Cannot call cpu when interrupts are enabled:
   // result not guaranteed to last long enough to be used!
@@ -118,6 +118,16 @@ lapic_eoi(void)
     lapicw(EOI, 0);
 }
 
+// Send interrupt vector to the CPU with local APIC ID apicid.
+void
+lapic_ipi(uchar apicid, int vector)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 static void
@@ -0,0 +1,208 @@
+// Lock dependency checking and lock profiling, compiled in
+// only when the kernel is built with LOCKDEP (make LOCKDEP=1).
+//
+// Locks fall into classes by name, the same classes that the
+// lock statistics in spinlock.c use.  Whenever a CPU acquires a
+// lock of class B while holding one of class A, lockdep records
+// the edge A -> B.  An edge that closes a cycle means that two
+// code paths take the same locks in opposite orders and can
+// deadlock; lockdep reports it the first time both orders are
+// seen, whether or not the deadlock happened.  tryacquire never
+// waits, so it adds no edges, and neither does taking two locks
+// of one class (such as two proc locks in sched).
+//
+// lockdep also keeps, for each class, log2 histograms of how
+// long CPUs waited for and held its locks, printed on ^L after
+// the lock statistics.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#ifdef LOCKDEP
+
+#define NHELD      16   // Most locks a CPU can hold at once
+#define NHIST      16   // Histogram buckets
+#define HISTSHIFT  7    // Bucket 0 is under 2^HISTSHIFT cycles
+
+static struct {
+  char *name;
+  uint after;                    // Bit b: class b taken holding this one
+  uint edgepc[NLOCKCLASS];       // Where each edge was first seen
+  uint wait[NCPU][NHIST];        // Cycles spent waiting, log2
+  uint hold[NCPU][NHIST];        // Cycles held, log2
+} classes[NLOCKCLASS];
+
+// Classes of the locks each CPU holds, in acquisition order.
+static struct {
+  int class[NHELD];
+  int n;
+  int busy;                      // Reporting; don't track
+} held[NCPU];
+
+static uint graph_busy;
+
+static void
+hist(uint *h, unsigned long long cyc)
+{
+  int b;
+
+  cyc >>= HISTSHIFT;
+  for(b = 0; cyc != 0 && b < NHIST-1; b++)
+    cyc >>= 1;
+  h[b]++;
+}
+
+// Is class to reachable from class from in the order graph?
+// If so, fill in parent[] with a path back to from.
+static int
+reachable(int from, int to, int *parent)
+{
+  uint seen, frontier, next;
+  int i, j;
+
+  seen = frontier = 1 << from;
+  while(frontier){
+    next = 0;
+    for(i = 0; i < NLOCKCLASS; i++){
+      if(!(frontier & (1 << i)))
+        continue;
+      for(j = 0; j < NLOCKCLASS; j++){
+        if((classes[i].after & (1 << j)) && !(seen & (1 << j))){
+          parent[j] = i;
+          next |= 1 << j;
+          seen |= 1 << j;
+        }
+      }
+    }
+    if(seen & (1 << to))
+      return 1;
+    frontier = next;
+  }
+  return 0;
+}
+
+// Print the cycle closed by the new edge a -> b.
+static void
+report(int a, int b, int *parent)
+{
+  int i;
+
+  cprintf("lockdep: cpu%d: acquired %s at %p while holding %s,\n",
+          cpu(), classes[b].name, classes[a].edgepc[b], classes[a].name);
+  cprintf("lockdep: but the opposite order was seen before:\n");
+  for(i = a; i != b; i = parent[i])
+    cprintf("lockdep:   %s taken holding %s at %p\n",
+            classes[i].name, classes[parent[i]].name,
+            classes[parent[i]].edgepc[i]);
+}
+
+static void
+addedge(int a, int b, uint pc)
+{
+  int parent[NLOCKCLASS];
+  int cycle;
+
+  if(a == b || (classes[a].after & (1 << b)))
+    return;
+  while(xchg(&graph_busy, 1) == 1)
+    ;
+  cycle = reachable(b, a, parent);
+  if(!(classes[a].after & (1 << b))){
+    classes[a].edgepc[b] = pc;
+    classes[a].after |= 1 << b;
+  }
+  xchg(&graph_busy, 0);
+  if(cycle)
+    report(a, b, parent);
+}
+
+// Note that this CPU has acquired lock, having waited wait
+// cycles for it.  trylock is set for tryacquire.
+void
+lockdep_acquire(struct spinlock *lock, int trylock, unsigned long long wait)
+{
+  int class, c, i;
+
+  c = mycpu()->id;
+  if((class = lockclass(lock)) < 0 || held[c].busy)
+    return;
+  classes[class].name = lock->name;
+  if(!trylock){
+    hist(classes[class].wait[c], wait);
+    held[c].busy = 1;
+    for(i = 0; i < held[c].n; i++)
+      addedge(held[c].class[i], class, lock->pcs[0]);
+    held[c].busy = 0;
+  }
+  if(held[c].n < NHELD)
+    held[c].class[held[c].n++] = class;
+}
+
+// Note that this CPU is releasing lock after holding
+// it for hold cycles.
+void
+lockdep_release(struct spinlock *lock, unsigned long long hold)
+{
+  int class, c, i;
+
+  c = mycpu()->id;
+  if((class = lockclass(lock)) < 0 || held[c].busy)
+    return;
+  hist(classes[class].hold[c], hold);
+  for(i = held[c].n - 1; i >= 0; i--){
+    if(held[c].class[i] == class){
+      held[c].n--;
+      for(; i < held[c].n; i++)
+        held[c].class[i] = held[c].class[i+1];
+      break;
+    }
+  }
+}
+
+static void
+printhist(char *what, uint (*h)[NHIST])
+{
+  uint sum[NHIST];
+  int b, c, last;
+
+  last = -1;
+  for(b = 0; b < NHIST; b++){
+    sum[b] = 0;
+    for(c = 0; c < NCPU; c++)
+      sum[b] += h[c][b];
+    if(sum[b])
+      last = b;
+  }
+  cprintf("  %s:", what);
+  for(b = 0; b <= last; b++)
+    cprintf(" %d", sum[b]);
+  cprintf("\n");
+}
+
+// Print each class's wait and hold histograms.  Bucket b
+// counts times under 2^(HISTSHIFT+b) cycles.
+void
+lockdep_dump(void)
+{
+  int i, c;
+
+  c = mycpu()->id;
+  held[c].busy = 1;
+  cprintf("lockdep: wait/hold histograms, bucket 0 < %d cycles, x2 per bucket\n",
+          1 << HISTSHIFT);
+  for(i = 0; i < NLOCKCLASS; i++){
+    if(classes[i].name == 0)
+      continue;
+    cprintf("%s\n", classes[i].name);
+    printhist("wait", classes[i].wait);
+    printhist("hold", classes[i].hold);
+  }
+  held[c].busy = 0;
+}
+
+#endif
@@ -20,6 +20,7 @@ main(void)
   memset(edata, 0, end - edata);
 
   mp_init(); // collect info about this machine
+  seginit();
   lapic_init(mp_bcpu());
   cprintf("\ncpu%d: starting xv6\n\n", cpu());
   cprintf("count = %d\n",*count);
@@ -27,18 +28,26 @@ main(void)
   cprintf("mem baseadd: %x %x\nmen len : %x %x\n",*(p + 1),*p, *(p+3), *(p+2));
 
   pinit();         // process table
-  binit();         // buffer cache
   pic_init();      // interrupt controller
   ioapic_init();   // another interrupt controller
   kinit();         // physical memory allocator
+  vmalloc_init();  // kernel virtual memory areas
+  binit();         // buffer cache
+  lru_init();      // page reclaim
   tvinit();        // trap vectors
+  ktimer_init();   // kernel timer wheels
+  tlb_init();      // TLB shootdowns
+  rcu_init();      // read-copy-update
   fileinit();      // file table
   iinit();         // inode cache
   console_init();  // I/O devices & their interrupts
   ide_init();      // disk
+  swapinit();      // swap area
   if(!ismp)
     timer_init();  // uniprocessor timer
   userinit();      // first user process
+  kzinit();        // page zeroing thread
+  kswapinit();     // page reclaim thread
   bootothers();    // start other processors
 
   // Finish setting up this processor in mpmain.
@@ -51,6 +60,8 @@ static void
 mpmain(void)
 {
   extern paddr_t boot_cr3;
+  if(lapicid() != mp_bcpu())
+    seginit();
   cprintf("cpu%d: mpmain\n", cpu());
   idtinit();
   if(cpu() != mp_bcpu()) {
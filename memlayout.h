@@ -7,5 +7,16 @@
 // virtual address space into that 4 Meg region starting at VPT.
 #define VPT      0x7fc00000  // virtual page table 
 #define UVPT     0x7f800000  // virtual page table for user
+// Kernel virtual memory areas (vmalloc.c), below UVPT.  Physical
+// memory, which is mapped at its own address, must end below.
+#define VMALLOC_START 0x7d800000
+#define VMALLOC_END   UVPT
 #define KSTACKTOP 0xfeb00000  // kernel stack top
+// The 4 Meg slot PDX(KSTACKTOP-1) holds only the kernel stack,
+// with an unmapped guard page just below it; see kstack.c.
+#define KSTACKGUARD (KSTACKTOP - KSTACKSIZE - PAGE)
+// User memory, from KERNTOP, must end below that slot: a user
+// page in the kernel stack's page table, or in the page tables
+// shared from boot_pgdir above it, would outlive the process.
+#define USERTOP  0xfe800000  // PDX(KSTACKTOP-1) << PDXSHIFT
 #endif
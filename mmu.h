@@ -68,6 +68,10 @@
 #define PTXSHIFT   12  // offset of PTX in a linear address
 #define PTENTRY    1024  // number of entries in page table
 #define PTSIZE     PAGE * PTENTRY  // size of the whole page table
+#define LPAGE      (1 << PDXSHIFT)  // size of a large (PTE_PS) page
+
+// cpuid(1) %edx feature bits
+#define CPUID_PSE  0x00000008  // Page Size Extensions
 
 // Eflags register
 #define FL_CF           0x00000001      // Carry Flag
@@ -1,13 +1,17 @@
 #ifndef _PARAM_H_
 #define _PARAM_H_
-#define NPROC        64  // maximum number of processes
+#define NPROC       512  // maximum number of processes
 #define PAGE       4096  // granularity of user-space memory allocation
 #define KSTACKSIZE 8*PAGE  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NBUF         10  // size of disk block cache
+#define NBUF         64  // size of disk block cache
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define SWAPDEV       0  // device number of the swap area
+#define SWAPSTART  2048  // first sector of the swap area
+#define NSWAP      1024  // pages in the swap area
+#define FAULTAROUND  16  // pages mapped per page fault, by default
 #endif
@@ -74,33 +74,45 @@ pipeclose(struct pipe *p, int writable)
     kfree((char*)p, PAGE);
 }
 
+// User memory is copied through buf, outside p->lock:
+// touching it may fault, and the fault sleep for swap.
+#define PIPECHUNK 128
+
 int
 pipewrite(struct pipe *p, char *addr, int n)
 {
-  int i;
+  char buf[PIPECHUNK];
+  int i, j, m;
 
-  acquire(&p->lock);
-  for(i = 0; i < n; i++){
-    while(p->writep == p->readp + PIPESIZE) {
-      if(p->readopen == 0 || cp->killed){
-        release(&p->lock);
-        return -1;
+  for(i = 0; i < n; i += m){
+    m = n - i < PIPECHUNK ? n - i : PIPECHUNK;
+    memmove(buf, addr + i, m);
+    acquire(&p->lock);
+    for(j = 0; j < m; j++){
+      while(p->writep == p->readp + PIPESIZE) {
+        if(p->readopen == 0 || cp->killed){
+          release(&p->lock);
+          return -1;
+        }
+        wakeup(&p->readp);
+        sleep(&p->writep, &p->lock);
       }
-      wakeup(&p->readp);
-      sleep(&p->writep, &p->lock);
+      p->data[p->writep++ % PIPESIZE] = buf[j];
     }
-    p->data[p->writep++ % PIPESIZE] = addr[i];
+    wakeup(&p->readp);
+    release(&p->lock);
   }
-  wakeup(&p->readp);
-  release(&p->lock);
   return i;
 }
 
 int
 piperead(struct pipe *p, char *addr, int n)
 {
+  char buf[PIPECHUNK];
   int i;
 
+  if(n > PIPECHUNK)
+    n = PIPECHUNK;
   acquire(&p->lock);
   while(p->readp == p->writep && p->writeopen){
     if(cp->killed){
@@ -112,9 +124,10 @@ piperead(struct pipe *p, char *addr, int n)
   for(i = 0; i < n; i++){
     if(p->readp == p->writep)
       break;
-    addr[i] = p->data[p->readp++ % PIPESIZE];
+    buf[i] = p->data[p->readp++ % PIPESIZE];
   }
   wakeup(&p->writep);
   release(&p->lock);
+  memmove(addr, buf, i);
   return i;
 }
@@ -6,28 +6,50 @@
 #include "assert.h"
 #include "errorno.h"
 #include "spinlock.h"
+#include "rwlock.h"
 #include "buddy.h"
 
-spinlock_t phy_mem_lock;
+// Guards the shape of every page table tree: taken for writing
+// to hook a new page table into a page directory, and for reading
+// by walks.  The PTEs themselves belong to the address space's
+// owner, which is the only one to change them, so filling or
+// clearing a PTE in an existing table needs only a read lock and
+// walks on different CPUs never serialize.
+struct rwlock pgtab_lock;
 struct Page * pages;    // Physical Page descriptor array
 paddr_t boot_cr3;    // physical address of boot time page directory
 pde_t * boot_pgdir;    // virtual address of boot time page directory
 struct Page * pages;    // all page descriptors 
 //static uchar * boot_freemem = 0; // pointer to next byte of free mem
+int pse;    // CPU supports 4 Meg pages (PTE_PS)
+static char * scratch;    // see map_scratch
 
 static void check_boot_pgdir();
+static void tlbbench();
 
+// Map [la, la+size) to [pa, pa+size) in the boot page directory.
+// Wherever both addresses are 4 Meg aligned and a whole 4 Meg
+// page fits, use a single large page instead of a page table:
+// no page table page is spent on it, and it takes one TLB entry
+// instead of 1024.  The ragged ends get 4K pages.
 static void
 boot_map_segment(pde_t * pgdir, paddr_t pa, vaddr_t la, uint size, uint perm)
 {
 	int ret = 0;
 	uint i = 0;
 	assert(!(size & 0xfff), "size is not a multiple of PAGE\n");
-	for (; i < size; i += PAGE) {
+	while (i < size) {
+		if (pse && !((pa + i) & (LPAGE - 1)) && !((la + i) & (LPAGE - 1)) &&
+		    size - i >= LPAGE && !(pgdir[PDX(la + i)] & PTE_P)) {
+			pgdir[PDX(la + i)] = (pa + i) | PTE_PS | PTE_P | perm;
+			i += LPAGE;
+			continue;
+		}
 		if ((ret = insert_page(pgdir, pa + i, la + i, perm, 1)) < 0) {
 			cprintf("error %d\n",ret);
 			panic("error at boot map segment\n");
 		}
+		i += PAGE;
 	}
 }
 
@@ -53,41 +75,184 @@ map_segment(pde_t * pgdir, paddr_t pa, vaddr_t la, uint size, uint perm)
   return 0;
 }
 
+// Mappings that have been removed but whose pages cannot be
+// freed yet, because another CPU may still reach them through
+// a stale TLB entry.  Unmapping a range collects up to NGATHER
+// of them and then invalidates the whole span at once, so that
+// a large unmap costs one shootdown per batch, not per page.
+#define NGATHER 32
+
+struct gather {
+  pde_t * pgdir;
+  vaddr_t start, end;    // span of the collected mappings
+  int n;
+  vaddr_t va[NGATHER];   // the addresses unmapped
+  pte_t old[NGATHER];    // and the PTEs as they were
+};
+
+static int put_pte(pde_t * pgdir, vaddr_t va, pte_t old);
+
+// Invalidate the collected mappings and free their pages,
+// all in one call to the allocator.
+static void
+gather_flush(struct gather * g)
+{
+  char * freed[NGATHER];
+  int i, n;
+  if (g->n == 0)
+    return;
+  tlb_invalidate(g->pgdir, g->start, g->end);
+  for (i = n = 0; i < g->n; i ++)
+    if (put_pte(g->pgdir, g->va[i], g->old[i]))
+      freed[n++] = (char *)PTE_ADDR(g->old[i]);
+  kfree_list(freed, n);
+  g->n = 0;
+}
+
+// Collect old, which was the PTE for va.
+static void
+gather_add(struct gather * g, vaddr_t va, pte_t old)
+{
+  if (g->n == NGATHER)
+    gather_flush(g);
+  if (g->n == 0 || va < g->start)
+    g->start = va;
+  if (g->n == 0 || va + PAGE > g->end)
+    g->end = va + PAGE;
+  g->va[g->n] = va;
+  g->old[g->n++] = old;
+}
+
+// Wait until the page at pte is no longer being moved.
+// Keeps answering TLB shootdowns, which the mover sends.
+static void
+migrate_wait(pte_t * pte)
+{
+  while (*(volatile pte_t *)pte & PTE_MIGRATE) {
+    tlb_ipi();
+    pause();
+  }
+}
+
+// Clear *pte and return what it held.  A page being moved
+// is waited for, so that the mover never writes to a page
+// table that is about to be freed.
+static pte_t
+clear_pte(pte_t * pte)
+{
+  pte_t old;
+  for (;;) {
+    migrate_wait(pte);
+    acquire_read(&pgtab_lock);
+    old = *pte;
+    if (!(old & PTE_MIGRATE) && cmpxchg(pte, old, 0) == old)
+      break;
+    release_read(&pgtab_lock);
+  }
+  release_read(&pgtab_lock);
+  return old;
+}
+
 int
 do_unmap(pde_t * pgdir, vaddr_t va, uint size)
 {
-  uint i,ret;
+  struct gather g;
+  pte_t * pte, old;
+  uint i;
+  int ret = 0;
   if (va & 0xfff || size & 0xfff)
     panic("do_unmap invalid va or size");
-  for (i = 0; i < size; i += PAGE) {
-    if ((ret = remove_page(pgdir, va)) < 0)
-      return ret;
-    va += PAGE;
+  g.pgdir = pgdir;
+  g.n = 0;
+  for (i = 0; i < size; i += PAGE, va += PAGE) {
+    acquire_read(&pgtab_lock);
+    pte = get_pte(pgdir, va, 0);
+    release_read(&pgtab_lock);
+    if (pte == NULL) {
+      ret = -E_ALREADY_FREE;
+      break;
+    }
+    old = clear_pte(pte);
+    if (old & PTE_SWAP) {
+      swap_free(SWPSLOT(old));
+      continue;
+    }
+    if (!(old & PTE_P)) {
+      ret = -E_ALREADY_FREE;
+      break;
+    }
+    gather_add(&g, va, old);
   }
-  return 0;
+  gather_flush(&g);
+  return ret;
+}
+
+// Unmap whatever is mapped, or in swap, in [va, va + size),
+// and free the pages no longer mapped anywhere.  Unlike
+// do_unmap, holes are fine.  Returns the number of pages
+// unmapped.
+int
+unmap_range(pde_t * pgdir, vaddr_t va, uint size)
+{
+  struct gather g;
+  pte_t * pte, old;
+  vaddr_t end;
+  int n = 0;
+  if (va & 0xfff || size & 0xfff)
+    panic("unmap_range invalid va or size");
+  g.pgdir = pgdir;
+  g.n = 0;
+  for (end = va + size; va < end; va += PAGE) {
+    if ((pgdir[PDX(va)] & (PTE_P | PTE_PS)) != PTE_P) {
+      // No page table: skip to the next one.
+      va = (PDX(va) + 1) * LPAGE - PAGE;
+      continue;
+    }
+    pte = (pte_t *)PTE_ADDR(pgdir[PDX(va)]) + PTX(va);
+    if (*pte == 0)
+      continue;
+    old = clear_pte(pte);
+    if (old & PTE_P) {
+      gather_add(&g, va, old);
+      n++;
+    } else if (old & PTE_SWAP) {
+      swap_free(SWPSLOT(old));
+      n++;
+    }
+  }
+  gather_flush(&g);
+  return n;
 }
 
 int
 unmap_userspace(pde_t * pgdir)
 {
-  uint index,pteidx,ret;
-  pte_t * pte;
+  struct gather g;
+  uint index,pteidx;
+  pte_t * pte, old;
   if (!pgdir)
     return 0;
+  // The kernel stack's slot is left to kstack_free.
   dbmsg("unmap user space\n");
-  for (index = PDX(KERNTOP); index < PDX(0xfec00000); index ++) {
-    if (pgdir[index] & PTE_P) {
+  g.pgdir = pgdir;
+  g.n = 0;
+  for (index = PDX(KERNTOP); index < PDX(KSTACKTOP - 1); index ++) {
+    if ((pgdir[index] & (PTE_P | PTE_PS)) == PTE_P) {
       pte = (pte_t *)PTE_ADDR(pgdir[index]);
       for (pteidx = 0; pteidx < PTENTRY; pteidx ++) {
-        if (pte[pteidx] & PTE_P) {
-          ret = remove_pte(pgdir, &pte[pteidx]);
-          if (ret < 0)
-            return ret;
+        // Not just present PTEs: a marked one must be waited
+        // for, and a swap entry's slot freed.
+        if (pte[pteidx]) {
+          old = clear_pte(&pte[pteidx]);
+          if (old & PTE_P)
+            gather_add(&g, (index << PDXSHIFT) | (pteidx << PTXSHIFT), old);
+          else if (old & PTE_SWAP)
+            swap_free(SWPSLOT(old));
         }
       }
-      remove_pte(pgdir, pte);
     }
   }
+  gather_flush(&g);
   return 0;
 }
 
@@ -107,33 +272,63 @@ alloc_page()
 // -E_NOT_AT_PGBOUND, if pa or va is not at page boundary
 // -E_NO_MEM, if the page table couldn't be allocated
 // -E_MAP_EXIST, if there is already a page mapped at 'va'
+//
+// Since it never replaces a present PTE, there is nothing
+// stale in any TLB to invalidate.
 int
 insert_page(pde_t * pgdir, paddr_t pa, vaddr_t va, uint perm, uint kmap)
 {
 	if ((pa & 0xfff) || (va & 0xfff))
 		return -E_NOT_AT_PGBOUND;
 
-	acquire(&phy_mem_lock);
-	pte_t * pte = get_pte(pgdir, va, 1);
+	pte_t * pte;
+	int excl, newpt, ret;
 
-	if (pte == NULL) {
-		release(&phy_mem_lock);
-		return -E_NO_MEM;
-	}
+	// A user mapping goes into the reverse map first, so that
+	// the map never lacks a mapping that the mapcount counts,
+	// and onto the LRU before the PTE is live: once it is, the
+	// owner may unmap and free the page at any moment.
+	if (!kmap && (ret = rmap_add(page_frame(pa), pgdir, va)) < 0)
+		return ret;
+	if (!kmap)
+		lru_add(page_frame(pa));
 
-	if (*pte & PTE_P) {
-		release(&phy_mem_lock);
-		return -E_MAP_EXIST;
+	excl = 0;
+	acquire_read(&pgtab_lock);
+	if ((pte = get_pte(pgdir, va, 0)) == NULL) {
+		// Needs a new page table: that changes the tree.
+		release_read(&pgtab_lock);
+		acquire_write(&pgtab_lock);
+		excl = 1;
+		newpt = !(pgdir[PDX(va)] & PTE_P);
+		pte = get_pte(pgdir, va, 1);
+		if (pte != NULL && newpt && !kmap)
+			page_frame(pgdir)->nptab++;
 	}
-	*pte = PTE_ADDR(pa) | PTE_P | perm;
 
-        if (!kmap) {
-          IncPageCount(page_frame(pa));
-        }
-        
-	release(&phy_mem_lock);
+	if (pte == NULL)
+		ret = -E_NO_MEM;
+	else if (*pte & (PTE_P | PTE_MIGRATE | PTE_SWAP))
+		ret = -E_MAP_EXIST;
+	else {
+		if (!kmap) {
+			IncPageCount(page_frame(pa));
+			atomic_inc(&page_frame(pgdir)->rss);
+		}
+		*pte = PTE_ADDR(pa) | PTE_P | perm;
+		ret = 0;
+	}
+	if (excl)
+		release_write(&pgtab_lock);
+	else
+		release_read(&pgtab_lock);
 
-	return 0;
+	if (ret < 0 && !kmap) {
+		rmap_del(page_frame(pa), pgdir, va);
+		if (!IsPageMapped(page_frame(pa)))
+			lru_del(page_frame(pa));
+	}
+	return ret;
 }
 
 // Remove the mapping at va
@@ -148,47 +343,396 @@ remove_page(pde_t * pgdir, vaddr_t va)
   pte_t * pte;
   if (va & 0xfff)
     return -E_NOT_AT_PGBOUND;
+  acquire_read(&pgtab_lock);
   pte = get_pte(pgdir, va, 0);
-  return remove_pte(pgdir, pte);
+  release_read(&pgtab_lock);
+  return remove_pte(pgdir, pte, va);
 }
 
-// Remove the mapping at pte
+// Remove the mapping at pte, which maps va
 // RETURNS:
 // 0 on success
 // -E_ALREADY_FREE if pte is already free
 // 
 int
-remove_pte(pde_t * pgdir, pte_t * pte)
+remove_pte(pde_t * pgdir, pte_t * pte, vaddr_t va)
 { 
-  struct Page * p;
-  acquire(&phy_mem_lock);
+  pte_t old;
+
   if (pte == NULL)
     return -E_ALREADY_FREE;
 
-  if (*pte & PTE_P) {
-    p = page_frame(PTE_ADDR(*pte));
-    DecPageCount(p);
-    if (!PageReserved(p) && !IsPageMapped(p)) {
-      dbmsg("removing mapping at pages %x\n", p - pages);
-      __free_pages(p, 1);
-    }
-    *pte = 0;
+  old = clear_pte(pte);
+  if (old & PTE_SWAP) {
+    swap_free(SWPSLOT(old));
+    return 0;
   }
-  else {
-    release(&phy_mem_lock);
+  if (!(old & PTE_P))
     return -E_ALREADY_FREE;
+  tlb_invalidate(pgdir, va, va + PAGE);
+  if (put_pte(pgdir, va, old))
+    kfree((char *)PTE_ADDR(old), PAGE);
+  return 0;
+}
+
+// Drop the reference that old, the removed PTE for va in pgdir,
+// held on its page.  Returns 1 if that was the last one, and
+// the caller must free the page.  The map count is atomic, so
+// only one caller sees the last mapping go.  The mapping must
+// already be gone from every TLB.
+static int
+put_pte(pde_t * pgdir, vaddr_t va, pte_t old)
+{
+  struct Page * p;
+
+  p = page_frame(PTE_ADDR(old));
+  if (PTE_ADDR(old) == (paddr_t)scratch)
+    return 0;    // never counted
+  rmap_del(p, pgdir, va);
+  atomic_dec(&page_frame(pgdir)->rss);
+  if (DecPageCount(p) && !PageReserved(p)) {
+    dbmsg("removing mapping at pages %x\n", p - pages);
+    lru_del(p);
+    return 1;
   }
+  return 0;
+}
+
+// rmap_walk callback: replace the PTE for va in pgdir, which
+// must map the page, with a PTE_MIGRATE marker.  Returns
+// non-zero to give up.
+static int
+unmap_mark(struct Page * p, pde_t * pgdir, vaddr_t va, void * arg)
+{
+  struct unmapping * u = arg;
+  paddr_t pa = page_addr(p);
+  pte_t * pte, old;
+
+  if (u->n == UNMAP_MAX)
+    return 1;
+  acquire_read(&pgtab_lock);
+  pte = get_pte(pgdir, va, 0);
+  release_read(&pgtab_lock);
+  if (pte == NULL)
+    return 1;
+  old = *pte;
+  if (!(old & PTE_P) || PTE_ADDR(old) != pa ||
+      cmpxchg(pte, old, pa | PTE_MIGRATE) != old)
+    return 1;
+  u->pgdir[u->n] = pgdir;
+  u->va[u->n] = va;
+  u->pte[u->n] = pte;
+  u->old[u->n++] = old;
+  return 0;
+}
+
+// Take every mapping of the user page p away, to move it to
+// another frame or out to swap.  Each PTE gets a PTE_MIGRATE
+// marker in place of PTE_P, so that the page stays put: a fault
+// on it, or an unmap, waits for the marker to go.  The caller
+// must have called pushcli, and keep it until unmap_finish or
+// unmap_cancel, since a CPU waiting for a marker may be
+// spinning with interrupts off.  Returns 0, or -1 if some
+// mapping could not be marked.
+int
+unmap_begin(struct Page * p, struct unmapping * u)
+{
+  int ok;
+
+  u->page = p;
+  u->n = 0;
+  acquire(&rmap_lock);
+  // Every mapping the map count knows of must be marked; one
+  // still on its way into the page table makes the count and
+  // the markers differ.
+  ok = !PageReserved(p) && rmap_walk(p, unmap_mark, u) == 0 &&
+       u->n > 0 && u->n == IsPageMapped(p);
+  release(&rmap_lock);
+  if (!ok) {
+    unmap_cancel(u);
+    return -1;
+  }
+  return 0;
+}
+
+// Flush the marked mappings from every TLB.  After this, nobody
+// can read or write the page.  No spin lock may be held.
+void
+unmap_flush(struct unmapping * u)
+{
+  int i;
+  for (i = 0; i < u->n; i++)
+    tlb_invalidate(u->pgdir[i], u->va[i], u->va[i] + PAGE);
+}
+
+// Put back the PTEs that unmap_begin marked.
+void
+unmap_cancel(struct unmapping * u)
+{
+  int i;
+  for (i = 0; i < u->n; i++)
+    *(volatile pte_t *)u->pte[i] = u->old[i];
+}
+
+// Replace the marked PTEs: with mappings of new, which takes
+// over the reverse map, map count and LRU place, or, if new is
+// 0, with entry, and the page is left unmapped.  Fails, and
+// puts the page back on the LRU and the old PTEs back, if the
+// page has been mapped again meanwhile.  The LRU is seen to
+// while the markers still keep anyone from freeing the page.
+// No spin lock may be held.
+int
+unmap_finish(struct unmapping * u, struct Page * new, pte_t entry)
+{
+  struct Page * p = u->page;
+  int i, ok;
 
-  release(&phy_mem_lock);
+  acquire(&rmap_lock);
+  ok = IsPageMapped(p) == u->n;
+  if (ok && new) {
+    atomic_set(&new->mapcount, u->n);
+    rmap_move(p, new);
+  }
+  if (ok)
+    atomic_set(&p->mapcount, 0);
+  release(&rmap_lock);
+  if (!ok) {
+    lru_add(p);
+    unmap_cancel(u);
+    return -1;
+  }
+  if (new)
+    lru_replace(p, new);
+  else {
+    for (i = 0; i < u->n; i++) {
+      rmap_del(p, u->pgdir[i], u->va[i]);
+      atomic_dec(&page_frame(u->pgdir[i])->rss);
+    }
+  }
+  for (i = 0; i < u->n; i++)
+    *(volatile pte_t *)u->pte[i] = new ? page_addr(new) | (u->old[i] & 0xfff) : entry;
   return 0;
 }
 
+// Move the user page old to a new frame, for compaction.  Every
+// mapping of it, found through the reverse map, is switched to
+// the copy; the owners may go on running meanwhile.  Returns 0
+// if old is no longer in use and the caller may free it, or -1
+// if old turned out not to be movable.
+int
+migrate_page(struct Page * old)
+{
+  struct unmapping u;
+  char * new;
+
+  if ((new = kalloc(PAGE)) == 0)
+    return -1;
+  pushcli();
+  if (unmap_begin(old, &u) < 0) {
+    popcli();
+    kfree(new, PAGE);
+    return -1;
+  }
+  unmap_flush(&u);
+  memmove(new, (char *)page_addr(old), PAGE);
+  if (unmap_finish(&u, page_frame(new), 0) < 0) {
+    popcli();
+    kfree(new, PAGE);
+    return -1;
+  }
+  popcli();
+  return 0;
+}
+
+// rmap_walk callback for page_referenced.
+static int
+test_young(struct Page * p, pde_t * pgdir, vaddr_t va, void * arg)
+{
+  int * young = arg;
+  pte_t * pte, old;
+
+  acquire_read(&pgtab_lock);
+  pte = get_pte(pgdir, va, 0);
+  release_read(&pgtab_lock);
+  if (pte == NULL)
+    return 0;
+  do {
+    old = *pte;
+    if (!(old & PTE_P) || PTE_ADDR(old) != page_addr(p) || !(old & PTE_A))
+      return 0;
+  } while (cmpxchg(pte, old, old & ~PTE_A) != old);
+  (*young)++;
+  return 0;
+}
+
+// Clear the accessed bits of p's mappings, and return how many
+// were set: the page's use since the last call.  The TLBs are
+// not flushed, so a mapping cached in one may go on being used
+// unseen; that only makes the page look a little older.
+int
+page_referenced(struct Page * p)
+{
+  int young = 0;
+
+  acquire(&rmap_lock);
+  rmap_walk(p, test_young, &young);
+  release(&rmap_lock);
+  return young;
+}
+
+// The PTE for va in pgdir, or 0 if there is no page table.
+pte_t
+read_pte(pde_t * pgdir, vaddr_t va)
+{
+  pte_t * pte;
+
+  acquire_read(&pgtab_lock);
+  pte = get_pte(pgdir, va, 0);
+  release_read(&pgtab_lock);
+  return pte ? *pte : 0;
+}
+
+// Map p at va in place of the swap entry there, for swap_in.
+// Returns 0, or -1 if the PTE no longer holds entry.
+int
+map_swapped(pde_t * pgdir, vaddr_t va, pte_t entry, struct Page * p)
+{
+  pte_t * pte;
+
+  if (rmap_add(p, pgdir, va) < 0)
+    return -1;
+  // On the LRU before the PTE is live, as in insert_page.
+  lru_add(p);
+  IncPageCount(p);
+  acquire_read(&pgtab_lock);
+  pte = get_pte(pgdir, va, 0);
+  release_read(&pgtab_lock);
+  if (pte == NULL ||
+      cmpxchg(pte, entry, page_addr(p) | PTE_P | PTE_W | PTE_U) != entry) {
+    atomic_dec(&p->mapcount);
+    rmap_del(p, pgdir, va);
+    lru_del(p);
+    return -1;
+  }
+  atomic_inc(&page_frame(pgdir)->rss);
+  return 0;
+}
+
+// Map the scratch page at va in pgdir, in place of the page,
+// or swap entry, that the kernel touching va on the process's
+// behalf could not be given.  The access can then finish, and
+// with it the syscall; the caller kills the process, so the
+// page's contents, shared by all such mappings, are never
+// returned to user space.  Returns 0 when the access can be
+// retried, or -1 if there is no memory for the page table.
+int
+map_scratch(pde_t * pgdir, vaddr_t va)
+{
+  pte_t * pte, old;
+  int newpt;
+
+  acquire_write(&pgtab_lock);
+  newpt = !(pgdir[PDX(va)] & PTE_P);
+  if ((pte = get_pte(pgdir, va, 1)) != NULL && newpt)
+    page_frame(pgdir)->nptab++;
+  release_write(&pgtab_lock);
+  if (pte == NULL)
+    return -1;
+  old = *pte;
+  // Mapped, or being moved, meanwhile: just retry.
+  if (old != 0 && !(old & PTE_SWAP))
+    return 0;
+  memset(scratch, 0, PAGE);
+  if (cmpxchg(pte, old, (paddr_t)scratch | PTE_P | PTE_W) == old &&
+      (old & PTE_SWAP))
+    swap_free(SWPSLOT(old));
+  return 0;
+}
+
+// Each user address space counts the pages it has mapped, its
+// resident set, and the page tables holding them.  The counts
+// live in the struct Page of the page directory, where the code
+// above, which knows only pgdir, can reach them.  Kernel (kmap)
+// mappings are not counted.
+
+// Clear the counts of pgdir, a new page directory.
+void
+pgdir_init(pde_t * pgdir)
+{
+  atomic_set(&page_frame(pgdir)->rss, 0);
+  page_frame(pgdir)->nptab = 0;
+}
+
+// The number of user pages mapped in pgdir.
+uint
+pgdir_rss(pde_t * pgdir)
+{
+  return atomic_read(&page_frame(pgdir)->rss);
+}
+
+// The number of page tables holding user mappings in pgdir.
+uint
+pgdir_ptabs(pde_t * pgdir)
+{
+  return page_frame(pgdir)->nptab;
+}
+
+// If the page at va is being moved, wait for the move and
+// return 1; the faulting access can then be retried.
+int
+wait_migration(pde_t * pgdir, vaddr_t va)
+{
+  pte_t * pte;
+
+  acquire_read(&pgtab_lock);
+  pte = get_pte(pgdir, va, 0);
+  release_read(&pgtab_lock);
+  if (pte == NULL || !(*pte & PTE_MIGRATE))
+    return 0;
+  migrate_wait(pte);
+  return 1;
+}
+
+// Tear down the address space pgdir, which no process may be
+// running on: unmap the user memory, then free its page tables
+// and the page directory itself.  Idle CPUs that still have it
+// loaded are moved off it first.  The entries below KERNTOP and
+// from the I/O window up are shared with boot_pgdir and stay;
+// the kernel stack's entry is the caller's, for kstack_free.
+void
+free_pgdir(pde_t * pgdir)
+{
+  char * freed[NGATHER];
+  uint index;
+  int n;
+
+  tlb_release(pgdir);
+  unmap_userspace(pgdir);
+  n = 0;
+  for (index = PDX(KERNTOP); index < PDX(KSTACKTOP - 1); index ++) {
+    if ((pgdir[index] & (PTE_P | PTE_PS)) == PTE_P) {
+      if (n == NGATHER) {
+        kfree_list(freed, n);
+        n = 0;
+      }
+      freed[n++] = (char *)PTE_ADDR(pgdir[index]);
+    }
+    pgdir[index] = 0;
+  }
+  kfree_list(freed, n);
+  kfree((char *)pgdir, PAGE);
+}
+
 // Enable paging
 // Load cr3 and set PE & PG bit in cr0 register
 void
 enable_paging(void)
 {
 	uint cr0;
+	// large pages must be on before the page directory uses them
+	if (pse)
+		lcr4(rcr4() | CR4_PSE);
+
 	// install page talbe
 	lcr3(boot_cr3);
 
@@ -207,9 +751,14 @@ void
 i386_vm_init(void)
 {
 	pde_t * pgdir;
+	uint edx;
 	int i;
-	// init physical memory allocation and deallocation spin lock
-	initlock(&phy_mem_lock, "phy_mem");
+	// init the page table lock
+	initrwlock(&pgtab_lock, "pgtab");
+	rmap_init();
+
+	cpuid(1, 0, 0, 0, &edx);
+	pse = (edx & CPUID_PSE) != 0;
 
 	// create initial page directory , no need to acquire spin lock because
 	// no other processors are running
@@ -240,8 +789,14 @@ i386_vm_init(void)
 	// check the initial page directory has been set up correctly
 	check_boot_pgdir();
 
+	if ((scratch = alloc_page()) == 0)
+		panic("i386_vm_init: no scratch page");
+	SET_PAGE_RESERVED(page_frame(scratch));
+
 	enable_paging();
 	cprintf("Paging enabled!\n");
+
+	tlbbench();
 }
 
 // Given 'pgdir', a pointer to a page directory, get_pte returns
@@ -255,22 +810,24 @@ i386_vm_init(void)
 //    - pgdir_walk sets pp_ref to 1 for the new page table.
 //    - Finally, get_pte returns a pointer into the new page table.
 //
+// A large page (PTE_PS) has no page table, so get_pte returns
+// NULL for addresses inside one, even if create is set.  Only
+// the kernel's own mappings use large pages.
 
 pte_t *
 get_pte(pde_t * pgdir, vaddr_t va, int create)
 {
 	pde_t * pde = &pgdir[PDX(va)];
 	pte_t * pte = NULL;
+	if (*pde & PTE_PS)
+		return NULL;
 	if (!(*pde & PTE_P)) {
 		if (create) {
 			// allocate a page
 //                        cprintf("get pte addr %x, PDX %x, PDE %x, pgdir address %x\n", va, PDX(va), *pde, (uint)pgdir);
-			pte = (pte_t *)alloc_page();
+			pte = (pte_t *)kzalloc(PAGE);
 			if (pte == NULL) return NULL;
 			assert(!((uint)pte & 0xfff), "assert : not in page boundary\n");
-
-			// initialize
-			memset(pte,0,PAGE);
 			// set flags
 			*pde = (uint)pte | PTE_P | PTE_W | PTE_U;
 //                        cprintf("pde update %x, adddr %x\n", *pde, (uint)pde);
@@ -290,6 +847,8 @@ check_va2pa(pde_t * pgdir, vaddr_t va)
 {
 	if (!(pgdir[PDX(va)] & PTE_P))
 		return -1;
+	if (pgdir[PDX(va)] & PTE_PS)
+		return (pgdir[PDX(va)] & ~(LPAGE - 1)) | (va & (LPAGE - 1));
 	pte_t * pte = (pte_t *)PTE_ADDR(pgdir[PDX(va)]);
 	if (!(pte[PTX(va)] & PTE_P))
 		return -2;
@@ -314,3 +873,85 @@ check_boot_pgdir()
 			cprintf("address translate error %x\n",i);
 	}
 }
+
+// Size of the region tlbbench walks: bigger than the TLB
+// can cover with 4K pages, but only four large pages.
+#define TLBBENCH_SIZE (4 * LPAGE)
+
+// Cycles per page to read one word from every 4K page of
+// [va, va + TLBBENCH_SIZE), with a cold TLB.
+static uint
+tlbwalk(vaddr_t va)
+{
+	unsigned long long t0;
+	volatile uint *p;
+	uint i, pass, sum;
+
+	sum = 0;
+	t0 = rdtsc();
+	for (pass = 0; pass < 4; pass ++) {
+		lcr3(rcr3());
+		for (i = 0; i < TLBBENCH_SIZE; i += PAGE) {
+			p = (volatile uint *)(va + i);
+			sum += *p;
+		}
+	}
+	return (uint)(rdtsc() - t0) / (4 * TLBBENCH_SIZE / PAGE);
+}
+
+// Compare reads through the large-page identity map with
+// reads of the same memory through a temporary alias built
+// from 4K pages, which is what every kernel mapping used to
+// be.  Runs once at boot, before any process shares the
+// boot page directory.
+static void
+tlbbench()
+{
+	pde_t * pgdir = boot_pgdir;
+	vaddr_t alias;
+	paddr_t pa;
+	uint i;
+
+	// an identity-mapped large-page region to read
+	for (pa = LPAGE; pa < KERNTOP; pa += LPAGE) {
+		for (i = 0; i < TLBBENCH_SIZE; i += LPAGE)
+			if (!(pgdir[PDX(pa + i)] & PTE_PS))
+				break;
+		if (i == TLBBENCH_SIZE)
+			break;
+	}
+	if (pa >= KERNTOP) {
+		cprintf("tlbbench: no large pages (pse %d)\n", pse);
+		return;
+	}
+
+	// an unused, aligned window below the virtual page tables
+	for (alias = UVPT - TLBBENCH_SIZE; alias >= LPAGE; alias -= LPAGE) {
+		for (i = 0; i < TLBBENCH_SIZE; i += LPAGE)
+			if (pgdir[PDX(alias + i)] & PTE_P)
+				break;
+		if (i == TLBBENCH_SIZE)
+			break;
+	}
+	if (alias < LPAGE)
+		return;
+	for (i = 0; i < TLBBENCH_SIZE; i += PAGE) {
+		if (insert_page(pgdir, pa + i, alias + i, PTE_W, 1) < 0) {
+			cprintf("tlbbench: no memory for page tables\n");
+			goto out;
+		}
+	}
+
+	cprintf("tlbbench: %d cycles/page with 4M pages, %d with 4K pages\n",
+		tlbwalk(pa), tlbwalk(alias));
+
+out:
+	// the alias mappings were not counted, so just free
+	// the page tables
+	for (i = 0; i < TLBBENCH_SIZE; i += LPAGE) {
+		if (pgdir[PDX(alias + i)] & PTE_P)
+			kfree((char *)PTE_ADDR(pgdir[PDX(alias + i)]), PAGE);
+		pgdir[PDX(alias + i)] = 0;
+	}
+	lcr3(rcr3());
+}
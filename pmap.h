@@ -4,7 +4,6 @@
 #include "types.h"
 #include "mmu.h"
 #include "atomic.h"
-#define NULL ((void *) 0)
 
 // define some constants for bios interrupt 15h AX = E820h
 #define E820MAX    32  // number of entries in E820MAP
@@ -16,6 +15,8 @@
 #define PG_property  2  // the property field of the page descriptor stores meaningful data
 #define PG_locked    4  // the page is locked
 #define PG_dirty     8  // the page has been modified
+#define PG_lru      16  // the page is on an LRU list (vmscan.c)
+#define PG_active   32  // ... the active one
 
 struct e820map {
 	int nr_map;
@@ -32,10 +33,14 @@ typedef LIST_ENTRY(Page) page_list_entry_t;
 
 struct Page {
 	uint32_t flags;  // flags for page descriptors
-	uint32_t mapcount;  // number of page table entries that refer to the page frame
+	atomic_t mapcount;  // number of page table entries that refer to the page frame
 	uint32_t property;  // when the page is free , this field is used by the buddy system
-	uint32_t index;
+	atomic_t rss;     // of a page directory: user pages mapped
+	uint32_t nptab;   // and page tables under it (pgdir_init)
 	page_list_entry_t lru; /* free list link */
+	pde_t * rmap_pgdir;  // reverse map (rmap.c): the first user mapping
+	vaddr_t rmap_va;     // of the page, if rmap_pgdir is set,
+	struct rmap * rmap_next;  // and a chain of any others
 };
 
 typedef struct Page page_t;
@@ -56,9 +61,46 @@ char * alloc_page();
 int map_segment(pde_t * pgdir, paddr_t pa, vaddr_t la, uint size, uint perm);
 int remove_page(pde_t * pgdir, vaddr_t va);
 int do_unmap(pde_t * pgdir, vaddr_t va, uint size);
-int remove_pte(pde_t * pgdir, pte_t * pte);
+int unmap_range(pde_t * pgdir, vaddr_t va, uint size);
+int remove_pte(pde_t * pgdir, pte_t * pte, vaddr_t va);
 int unmap_userspace(pde_t * pgdir);
+void free_pgdir(pde_t * pgdir);
 paddr_t check_va2pa(pde_t * pgdir, vaddr_t va);
+int migrate_page(struct Page * old);
+int wait_migration(pde_t * pgdir, vaddr_t va);
+int page_referenced(struct Page * p);
+pte_t read_pte(pde_t * pgdir, vaddr_t va);
+int map_swapped(pde_t * pgdir, vaddr_t va, pte_t entry, struct Page * p);
+int map_scratch(pde_t * pgdir, vaddr_t va);
+void pgdir_init(pde_t * pgdir);
+uint pgdir_rss(pde_t * pgdir);
+uint pgdir_ptabs(pde_t * pgdir);
+
+// Software PTE bits, in the bits the MMU leaves to us.
+// PTE_P is clear in a PTE with either of them.
+#define PTE_MIGRATE  0x200  // the page is being moved or swapped out
+#define PTE_SWAP     0x400  // the page is in swap slot SWPSLOT(pte)
+
+#define SWPENTRY(slot)  (((slot) << PTXSHIFT) | PTE_SWAP)
+#define SWPSLOT(pte)    ((pte) >> PTXSHIFT)
+
+// The mappings of a page that is being taken away from its
+// owners (see unmap_begin).
+#define UNMAP_MAX 16
+struct unmapping {
+  struct Page * page;
+  int n;
+  pde_t * pgdir[UNMAP_MAX];
+  vaddr_t va[UNMAP_MAX];
+  pte_t * pte[UNMAP_MAX];
+  pte_t old[UNMAP_MAX];    // the PTEs before marking
+};
+int unmap_begin(struct Page * p, struct unmapping * u);
+void unmap_flush(struct unmapping * u);
+void unmap_cancel(struct unmapping * u);
+int unmap_finish(struct unmapping * u, struct Page * new, pte_t entry);
+
+extern struct spinlock rmap_lock;
 
 #define SET_PAGE_RESERVED(page) ((page)->flags |= PG_reserved)
 #define CLEAR_PAGE_RESERVED(page) ((page)->flags &= (~PG_reserved))
@@ -66,7 +108,8 @@ paddr_t check_va2pa(pde_t * pgdir, vaddr_t va);
 #define SetPageProperty(page) ((page)->flags |= PG_property)
 #define ClearPageProperty(page) ((page)->flags &= (~PG_property))
 #define PageProperty(page) ((page)->flags & PG_property)
-#define IncPageCount(page) ((page)->mapcount ++)
-#define DecPageCount(page) ((page)->mapcount --)
-#define IsPageMapped(page)  ((page)->mapcount)
+#define IncPageCount(page) atomic_inc(&(page)->mapcount)
+// Returns true if the page has just lost its last mapping.
+#define DecPageCount(page) atomic_dec_and_test(&(page)->mapcount)
+#define IsPageMapped(page)  atomic_read(&(page)->mapcount)
 #endif
@@ -5,13 +5,60 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "rcu.h"
 #include "pmap.h"
+#include "syscall.h"
+#include "procmem.h"
 #include "memlayout.h"
 
-struct spinlock proc_table_lock;
+// Locking:
+// p->lock guards each process's state and queue links; a CPU
+// running p holds p->lock across the swtch into and out of p.
+// Each sleep queue lock guards the list of processes sleeping on
+// channels that hash to it; a wait queue (see sleepon) is guarded
+// by a lock of its user's choosing, which ranks with the sleep
+// queue locks.  The run queue lock guards the run queue.
+// proc_tree_lock guards the parent and child links used by
+// wait and exit, and proc_free_lock the free list and nextpid.
+// pidhash_lock serializes changes to the pid hash and the allproc
+// list; lookups in them (kill, procdump) are RCU readers and take
+// no lock.  A freed proc goes back on the free list only after an
+// RCU grace period, so a reader never follows the hash links of a
+// proc that has been reused.  Locks are acquired in the order
+//   proc_tree_lock, sleep queue, pidhash_lock, p->lock, run queue.
+struct spinlock proc_tree_lock;
+static struct spinlock proc_free_lock;
+static struct spinlock pidhash_lock;
 
-struct proc proc[NPROC];
+// The process table grows a page of procs at a time when the
+// free list runs dry, up to NPROC procs.  Procs are never given
+// back, so a pointer to one stays valid, and allproc links every
+// proc ever made.
+static struct proc *allproc;
+static int nproc;
 static struct proc *initproc;
+static proc_list_t freeprocs;
+
+// Procs with a pid, hashed by pid.
+#define NPIDHASH 64
+#define PIDHASH(pid) (&pidhash[(uint)(pid) % NPIDHASH])
+static proc_list_t pidhash[NPIDHASH];
+
+// Processes waiting for a wakeup, hashed by channel.
+#define NSLEEPQ 64
+#define SQHASH(chan) (&sleepq[((uint)(chan) >> 2) % NSLEEPQ])
+static struct sleepq {
+  struct spinlock lock;
+  proc_list_t procs;
+} sleepq[NSLEEPQ];
+
+// RUNNABLE processes, in the order they became runnable.
+static struct {
+  struct spinlock lock;
+  struct proc *volatile head;
+  struct proc *tail;
+} runq;
 
 int nextpid = 1;
 extern void forkret(void);
@@ -20,30 +67,166 @@ extern void forkret1(struct trapframe*);
 void
 pinit(void)
 {
-  initlock(&proc_table_lock, "proc_table");
+  int i;
+
+  initlock(&proc_tree_lock, "proc_tree");
+  initlock(&proc_free_lock, "proc_free");
+  initlock(&pidhash_lock, "pidhash");
+  initlock(&runq.lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+}
+
+// Add a page worth of UNUSED procs to the free list.
+// Caller must hold proc_free_lock.
+// Returns 0 if the table is full or out of memory.
+static int
+growproctable(void)
+{
+  struct proc *p, *pp;
+
+  if(nproc >= NPROC || (pp = (struct proc*)kzalloc(PAGE)) == 0)
+    return 0;
+  acquire(&pidhash_lock);
+  for(p = pp; p + 1 <= (struct proc*)((char*)pp + PAGE) && nproc < NPROC; p++, nproc++){
+    initlock(&p->lock, "proc");
+    LIST_INSERT_HEAD(&freeprocs, p, qlink);
+    p->allnext = allproc;
+    allproc = p;
+  }
+  release(&pidhash_lock);
+  return 1;
 }
 
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc off the free list and give it a pid.
 // If found, change state to EMBRYO and return it.
 // Otherwise return 0.
 static struct proc*
 allocproc(void)
 {
-  int i;
   struct proc *p;
 
-  acquire(&proc_table_lock);
-  for(i = 0; i < NPROC; i++){
-    p = &proc[i];
-    if(p->state == UNUSED){
-      p->state = EMBRYO;
-      p->pid = nextpid++;
-      release(&proc_table_lock);
-      return p;
-    }
+  acquire(&proc_free_lock);
+  if(LIST_EMPTY(&freeprocs) && !growproctable()){
+    release(&proc_free_lock);
+    return 0;
   }
-  release(&proc_table_lock);
-  return 0;
+  p = LIST_FIRST(&freeprocs);
+  LIST_REMOVE(p, qlink);
+  p->pid = nextpid++;
+  release(&proc_free_lock);
+
+  LIST_INIT(&p->children);
+  p->parent = 0;
+
+  acquire(&pidhash_lock);
+  LIST_INSERT_HEAD(PIDHASH(p->pid), p, hlink);
+  release(&pidhash_lock);
+
+  acquire(&p->lock);
+  p->state = EMBRYO;
+  release(&p->lock);
+  return p;
+}
+
+// Put a proc on the free list once no RCU reader
+// can still be looking at it.
+static void
+freeproc_rcu(struct rcu_head *head)
+{
+  struct proc *p;
+
+  p = (struct proc*)((char*)head - (uint)&((struct proc*)0)->rcu);
+  acquire(&proc_free_lock);
+  LIST_INSERT_HEAD(&freeprocs, p, qlink);
+  release(&proc_free_lock);
+}
+
+// Return p to the free list.
+static void
+freeproc(struct proc *p)
+{
+  acquire(&pidhash_lock);
+  LIST_REMOVE(p, hlink);
+  release(&pidhash_lock);
+
+  acquire(&p->lock);
+  p->state = UNUSED;
+  p->pid = 0;
+  p->killed = 0;
+  p->name[0] = 0;
+  release(&p->lock);
+
+  call_rcu(&p->rcu, freeproc_rcu);
+}
+
+// Append p to the run queue.  Caller must hold p->lock
+// and have set p->state to RUNNABLE.
+static void
+runq_add(struct proc *p)
+{
+  acquire(&runq.lock);
+  p->rqnext = 0;
+  if(runq.tail)
+    runq.tail->rqnext = p;
+  else
+    runq.head = p;
+  runq.tail = p;
+  release(&runq.lock);
+}
+
+// Put p back at the head of the run queue.
+static void
+runq_push(struct proc *p)
+{
+  acquire(&runq.lock);
+  p->rqnext = runq.head;
+  runq.head = p;
+  if(runq.tail == 0)
+    runq.tail = p;
+  release(&runq.lock);
+}
+
+// Remove and return the process at the head of the run queue,
+// or 0 if it is empty.
+static struct proc*
+runq_get(void)
+{
+  struct proc *p;
+
+  // Idle CPUs poll here: peek first so that they do not
+  // keep stealing the lock's cache line from busy ones.
+  if(runq.head == 0)
+    return 0;
+  acquire(&runq.lock);
+  if((p = runq.head) != 0){
+    runq.head = p->rqnext;
+    if(runq.head == 0)
+      runq.tail = 0;
+    p->rqnext = 0;
+  }
+  release(&runq.lock);
+  return p;
+}
+
+// Mark p RUNNABLE and put it on the run queue.
+// Caller must hold p->lock.
+static void
+makerunnable(struct proc *p)
+{
+  p->state = RUNNABLE;
+  runq_add(p);
+}
+
+// Let a newly created process run.
+void
+setrunnable(struct proc *p)
+{
+  acquire(&p->lock);
+  if(p->state != EMBRYO)
+    panic("setrunnable");
+  makerunnable(p);
+  release(&p->lock);
 }
 
 // Grow current process's memory by n bytes.
@@ -52,20 +235,80 @@ int
 kgrowproc(int n)
 {
   char *newmem;
-  newmem = kalloc(n);
-  if (newmem == 0)
+  int i;
+
+  if (n < 0 || n > USERTOP - KERNTOP - cp->sz)
     return -1;
-  memset(newmem, 0, n);
-  map_segment(cp->vm.pgdir, (paddr_t)newmem, KERNTOP + cp->sz, n, PTE_P | PTE_W | PTE_U);
+  // A page at a time, so that each can come zeroed
+  // from the pool.
+  for (i = 0; i < n; i += PAGE) {
+    if ((newmem = kzalloc(PAGE)) == 0)
+      goto bad;
+    if (map_segment(cp->vm.pgdir, (paddr_t)newmem, KERNTOP + cp->sz + i, PAGE, PTE_P | PTE_W | PTE_U) < 0) {
+      kfree(newmem, PAGE);
+      goto bad;
+    }
+  }
   cp->sz += n;
   setupsegs(cp);
   return cp->sz - n;
+
+ bad:
+  do_unmap(cp->vm.pgdir, KERNTOP + cp->sz, i);
+  return -1;
 }
 
-// Grow current process's memory by n bytes.
+#define FAULTBATCH 16   // Most pages populate allocates at once
+
+// Map zeroed pages at the unmapped pages of [start, end) in
+// the current process, taking them from the allocator a batch
+// at a time.  Pages already mapped, or in swap, are left alone.
+// Gives up quietly when memory runs short, or the process
+// reaches its RSS limit; the pages left out are faulted in
+// later.
+static void
+populate(vaddr_t start, vaddr_t end)
+{
+  vaddr_t va, miss[FAULTBATCH];
+  char *mem;
+  int i, n, room;
+
+  for (va = start; va < end; ) {
+    if ((room = cp->rsslimit - pgdir_rss(cp->vm.pgdir)) <= 0)
+      return;
+    if (room > FAULTBATCH)
+      room = FAULTBATCH;
+    for (n = 0; n < room && va < end; va += PAGE)
+      if (read_pte(cp->vm.pgdir, va) == 0)
+        miss[n++] = va;
+    if (n == 0)
+      continue;
+    // One buddy allocation for the batch, if a block is at
+    // hand; each page can still be freed on its own later.
+    // Not worth draining the pool or compacting for: the
+    // pages can come one at a time instead.
+    if (n > 1 && (mem = kalloc_nowait(n * PAGE)) != 0) {
+      memset(mem, 0, n * PAGE);
+      for (i = 0; i < n; i++)
+        if (map_segment(cp->vm.pgdir, (paddr_t)mem + i * PAGE, miss[i], PAGE, PTE_P | PTE_W | PTE_U) < 0)
+          kfree(mem + i * PAGE, PAGE);
+      continue;
+    }
+    for (i = 0; i < n; i++) {
+      if ((mem = kzalloc(PAGE)) == 0)
+        return;
+      if (map_segment(cp->vm.pgdir, (paddr_t)mem, miss[i], PAGE, PTE_P | PTE_W | PTE_U) < 0)
+        kfree(mem, PAGE);
+    }
+  }
+}
+
+// Grow current process's memory by n bytes, or shrink it if
+// n is negative, freeing the whole pages given up.
+// With SBRK_POPULATE, map the new memory now.
 // Return old size on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, int flags)
 {
   //char *newmem;
 
@@ -82,27 +325,104 @@ growproc(int n)
     return -1;
   memset(newmem, 0, n);
   map_segment(cp->vm.pgdir, (paddr_t)newmem, KERNTOP + cp->sz, n, PTE_P | PTE_W | PTE_U);*/
+  if (n < 0 && -n > cp->sz)
+    return -1;
+  if (n > 0 && n > USERTOP - KERNTOP - cp->sz)
+    return -1;
   cp->sz += n;
   setupsegs(cp);
+  if (n < 0) {
+    unmap_range(cp->vm.pgdir, ROUNDUP(KERNTOP + cp->sz, PAGE),
+                ROUNDUP(cp->sz - n, PAGE) - ROUNDUP(cp->sz, PAGE));
+    // The rest of the last page stays mapped; clear it, so
+    // that growing again gives zeroed memory.
+    if (cp->sz % PAGE && read_pte(cp->vm.pgdir, PTE_ADDR(KERNTOP + cp->sz)))
+      memset(cp->mem + cp->sz, 0, ROUNDUP(cp->sz, PAGE) - cp->sz);
+  } else if (flags & SBRK_POPULATE)
+    populate(PTE_ADDR(KERNTOP + cp->sz - n), KERNTOP + cp->sz);
   return cp->sz - n;
 }
 
+// Advise the kernel about the use of the current process's
+// memory at [addr, addr + len), which must lie within its size.
+// MADV_DONTNEED frees the whole pages in the range; they read
+// as zero when next touched.  MADV_WILLNEED maps the pages not
+// yet mapped.  Return 0 on success, -1 on failure.
+int
+madvise(uint addr, uint len, int advice)
+{
+  vaddr_t start, end;
+
+  if (addr > cp->sz || len > cp->sz - addr)
+    return -1;
+  switch (advice) {
+  case MADV_DONTNEED:
+    start = ROUNDUP(KERNTOP + addr, PAGE);
+    end = ROUNDDOWN(KERNTOP + addr + len, PAGE);
+    if (start < end)
+      unmap_range(cp->vm.pgdir, start, end - start);
+    return 0;
+  case MADV_WILLNEED:
+    populate(PTE_ADDR(KERNTOP + addr), KERNTOP + addr + len);
+    return 0;
+  }
+  return -1;
+}
+
 // User space page fault handler
 // Return 0 on success, -1 on failure
+//
+// A fault from user mode fails once the process has as many
+// pages resident as its RSS limit allows.  One from the kernel,
+// touching user memory on the process's behalf, cannot fail
+// and may go over the limit.
 int
-pgfault_handler(vaddr_t faultaddr)
+pgfault_handler(vaddr_t faultaddr, int user)
 {
   char * newmem;
+  vaddr_t va, start, end;
+  pte_t pte;
   int ret;
   dbmsg("fault addr %x\n", faultaddr);
-  if (faultaddr < KERNTOP + cp->sz) {
-    newmem = kalloc(PAGE);
+  cp->nfault++;
+  if (faultaddr >= KERNTOP && faultaddr < KERNTOP + cp->sz && faultaddr < USERTOP) {
+    // A page being moved by compaction, or swapped
+    // out, is only missing until that is done.
+    if (wait_migration(cp->vm.pgdir, PTE_ADDR(faultaddr)))
+      return 0;
+    if (user && pgdir_rss(cp->vm.pgdir) >= cp->rsslimit)
+      return -1;
+    pte = read_pte(cp->vm.pgdir, PTE_ADDR(faultaddr));
+    if (pte & PTE_SWAP) {
+      if (swap_in(cp->vm.pgdir, PTE_ADDR(faultaddr), pte) == 0)
+        return 0;
+      if (reclaim(1) == 0)
+        return -1;
+      return swap_in(cp->vm.pgdir, PTE_ADDR(faultaddr), pte);
+    }
+    // Fault around: map the whole aligned window of
+    // faultaround pages, which the process will likely
+    // touch next, for the price of one fault.
+    va = PTE_ADDR(faultaddr);
+    if (cp->faultaround > 1) {
+      start = va & ~(cp->faultaround * PAGE - 1);
+      end = start + cp->faultaround * PAGE;
+      if (end > KERNTOP + cp->sz)
+        end = KERNTOP + cp->sz;
+      populate(start, end);
+      if (read_pte(cp->vm.pgdir, va) & PTE_P)
+        return 0;
+    }
+    newmem = kzalloc(PAGE);
+    // Out of memory: swap something out and try again.
+    if (newmem == 0 && reclaim(1) > 0)
+      newmem = kzalloc(PAGE);
     if (newmem == 0)
       return -1;
-    memset(newmem, 0, PAGE);
-    ret = map_segment(cp->vm.pgdir, (paddr_t)newmem, PTE_ADDR(faultaddr), PAGE, PTE_P | PTE_W | PTE_U);
+    ret = map_segment(cp->vm.pgdir, (paddr_t)newmem, va, PAGE, PTE_P | PTE_W | PTE_U);
     if (ret < 0) {
       dbmsg("pg fault handler fail %x\n", -ret);
+      kfree(newmem, PAGE);
       return -1;
     }
     return 0;
@@ -111,6 +431,25 @@ pgfault_handler(vaddr_t faultaddr)
     return -1;
 }
 
+// Set up this CPU's kernel segments, including SEG_KCPU,
+// whose base is the CPU's struct cpu, and point %gs at it.
+// Must run before anything calls cpu(), mycpu() or curproc().
+void
+seginit(void)
+{
+  struct cpu *c;
+
+  c = &cpus[lapicid()];
+  c->self = c;
+  c->id = c - cpus;
+  c->gdt[0] = SEG_NULL;
+  c->gdt[SEG_KCODE] = SEG(STA_X|STA_R, 0, 0x100000 + 64*1024-1, 0);
+  c->gdt[SEG_KDATA] = SEG(STA_W, 0, 0xffffffff, 0);
+  c->gdt[SEG_KCPU] = SEG(STA_W, (uint)&c->self, sizeof(*c)-1, 0);
+  lgdt(c->gdt, sizeof(c->gdt));
+  loadgs(SEG_KCPU << 3);
+}
+
 // Set up CPU's segment descriptors and task state for a given process.
 // If p==0, set up for "idle" state for when scheduler() is running.
 void
@@ -119,7 +458,7 @@ setupsegs(struct proc *p)
   struct cpu *c;
   
   pushcli();
-  c = &cpus[cpu()];
+  c = mycpu();
   c->ts.ss0 = SEG_KDATA << 3;
   if(p)
     c->ts.esp0 = (uint)(p->kstack + KSTACKSIZE);
@@ -134,28 +473,75 @@ setupsegs(struct proc *p)
   if(p){
     c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, (uint)KERNTOP, p->sz-1, DPL_USER);
     c->gdt[SEG_UDATA] = SEG(STA_W, (uint)KERNTOP, p->sz-1, DPL_USER);
+    c->usz = p->sz;
     c->cr3 = (paddr_t)(p->vm.pgdir);
     dbmsg("process %s load cr3 %x\n",p->name, c->cr3);
   } 
   else {
     c->gdt[SEG_UCODE] = SEG_NULL;
     c->gdt[SEG_UDATA] = SEG_NULL;
+    c->usz = 0;
     c->cr3 = (paddr_t)(boot_pgdir);  
   }
 
   lgdt(c->gdt, sizeof(c->gdt));
   ltr(SEG_TSS << 3);
-  lcr3(c->cr3);
+  // Changes to PTEs invalidate their own TLB entries
+  // (see tlb.c), so only a new address space needs cr3.
+  if(rcr3() != c->cr3)
+    lcr3(c->cr3);
   popcli();
 }
 
+// Switch this CPU's segments to p, for the context switch
+// path.  Unlike setupsegs, this only rewrites the TSS stack
+// and user segments if they differ from what is loaded, and
+// never reloads the gdt or task register.
+// Returns the page directory to load into cr3, or 0 if p's
+// is the one already in use, which saves the TLB flush.
+// The caller loads it with swtchvm: every kernel stack is
+// at the same virtual address, so cr3 must not change until
+// the switch is off the old stack.
+// Caller must have interrupts off.
+uint
+switchsegs(struct proc *p)
+{
+  struct cpu *c;
+  unsigned long long t0;
+  uint cr3;
+
+  t0 = rdtsc();
+  c = mycpu();
+  if(c->ts.esp0 != (uint)(p->kstack + KSTACKSIZE))
+    c->ts.esp0 = (uint)(p->kstack + KSTACKSIZE);
+  // The new user segments take effect when the
+  // segment registers are reloaded on return to user.
+  if(c->usz != p->sz){
+    c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, (uint)KERNTOP, p->sz-1, DPL_USER);
+    c->gdt[SEG_UDATA] = SEG(STA_W, (uint)KERNTOP, p->sz-1, DPL_USER);
+    c->usz = p->sz;
+  }
+  cr3 = 0;
+  if(c->cr3 != (paddr_t)p->vm.pgdir){
+    // Publish the new cr3 before swtchvm loads it, and make
+    // sure the store is seen first, so that tlb_invalidate
+    // either sees it or made its PTE change before the load.
+    cr3 = c->cr3 = (paddr_t)p->vm.pgdir;
+    mfence();
+    c->ncr3++;
+  }
+  c->nswitch++;
+  c->swcycles += rdtsc() - t0;
+  return cr3;
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
 struct proc*
 copyproc(struct proc *p)
 {
-  int i,ret;
+  int i;
   struct proc *np;
   char * kstack, * mem;
   pde_t * pgdir = 0;
@@ -165,52 +551,58 @@ copyproc(struct proc *p)
     return 0;
 
   // Allocate new page directory
-  pgdir = (pde_t *)alloc_page();
-  memset(pgdir, 0 ,PAGE);
+  if ((pgdir = (pde_t *)kzalloc(PAGE)) == 0) {
+    freeproc(np);
+    return 0;
+  }
   for (i = 0; i < PDX(KERNTOP); i++) {
     pgdir[i] = boot_pgdir[i];  
   }
   for (i = PDX(0xfec00000); i < PTENTRY; i++) {
     pgdir[i] = boot_pgdir[i];
   }
+  pgdir_init(pgdir);
   np->vm.pgdir = pgdir;
 
-  if ((kstack = kalloc(KSTACKSIZE)) == 0) {
-    np->state = UNUSED;
+  // Allocate kernel stack, which comes already mapped.
+  if (!kstack_alloc(&kstack, &np->kpt)) {
     kfree((char *)pgdir, PAGE);
+    freeproc(np);
     return 0;
   }
-
-  // Allocate kernel stack.
   np->kstack = (char *)(KSTACKTOP - KSTACKSIZE);
   np->k = kstack;
-  // kernel read/write
-  ret = map_segment(pgdir, (paddr_t)kstack, (vaddr_t)np->kstack, KSTACKSIZE, PTE_P | PTE_W);
-  if (ret < 0)
-    panic("kstack map error");
+  pgdir[PDX(KSTACKTOP - 1)] = (uint)np->kpt | PTE_P | PTE_W;
   np->tf = (struct trapframe*)(kstack + KSTACKSIZE) - 1;
+  np->faultaround = p ? p->faultaround : FAULTAROUND;
+  np->nfault = 0;
+  np->rsslimit = p ? p->rsslimit : RLIM_INFINITY;
 
   if(p){  // Copy process state from p.
-    np->parent = p;
     memmove(np->tf, p->tf, sizeof(*np->tf));
   
     np->sz = p->sz;
     if((mem = kalloc(np->sz)) == 0){
-      //kfree(np->kstack, KSTACKSIZE);
-      do_unmap(np->vm.pgdir, (vaddr_t)p->kstack, KSTACKSIZE);
+      kstack_free(np->k, np->kpt);
+      free_pgdir(np->vm.pgdir);
+      np->vm.pgdir = 0;
       np->kstack = 0;
-      np->state = UNUSED;
-      np->parent = 0;
+      freeproc(np);
       return 0;
     }
     memmove(mem, p->mem, np->sz);
-    ret = map_segment(pgdir, (paddr_t)mem, KERNTOP, np->sz, PTE_P | PTE_W | PTE_U);
+    map_segment(pgdir, (paddr_t)mem, KERNTOP, np->sz, PTE_P | PTE_W | PTE_U);
     np->mem = (char *)KERNTOP;
 
     for(i = 0; i < NOFILE; i++)
       if(p->ofile[i])
         np->ofile[i] = filedup(p->ofile[i]);
     np->cwd = idup(p->cwd);
+
+    acquire(&proc_tree_lock);
+    np->parent = p;
+    LIST_INSERT_HEAD(&p->children, np, sibling);
+    release(&proc_tree_lock);
   }
 
   // Set up new context to start executing at forkret (see below).
@@ -254,166 +646,339 @@ userinit(void)
   map_segment(p->vm.pgdir, (paddr_t)mem, KERNTOP, p->sz, PTE_P | PTE_W | PTE_U);
   p->mem = (char *)KERNTOP;
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->state = RUNNABLE;
-  
   initproc = p;
+  setrunnable(p);
 }
 
 // Return currently running process.
-struct proc*
-curproc(void)
+// Index of the running CPU in cpus[].
+int
+cpu(void)
 {
-  struct proc *p;
-
-  pushcli();
-  p = cpus[cpu()].curproc;
-  popcli();
-  return p;
+  return mycpu()->id;
 }
 
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - take a process off the run queue
 //  - swtch to start running that process
-//  - eventually that process transfers control
-//      via swtch back to the scheduler.
+//  - eventually the CPU comes back via swtch when
+//      there is nothing left to run.
+// While there is other work, sched() hands the CPU from
+// one process straight to the next without coming here.
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c;
-  int i;
 
-  c = &cpus[cpu()];
+  c = mycpu();
   for(;;){
     // Enable interrupts on this processor.
     sti();
+    rcu_qs();
 
-    // Loop over process table looking for process to run.
-    acquire(&proc_table_lock);
-    for(i = 0; i < NPROC; i++){
-      p = &proc[i];
-      if(p->state != RUNNABLE)
-        continue;
+    if((p = runq_get()) == 0)
+      continue;
 
-      // Switch to chosen process.  It is the process's job
-      // to release proc_table_lock and then reacquire it
-      // before jumping back to us.
-      c->curproc = p;
-      setupsegs(p);
-      p->state = RUNNING;
-      dbmsg("process %x c eip %x, p eip %x\n",i, c->context.eip, p->context.eip);
-//      if (check_va2pa(p->vm.pgdir, 0xfeaff000)<0)
-//        dbmsg("kstack map error");
-      swtch(&c->context, &p->context);
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->curproc = 0;
-      dbmsg("return to kernel\n");
-      setupsegs(0);
+    // Switch to chosen process.  It is the process's job
+    // to release p->lock and then reacquire it before
+    // jumping back to us.  If p is still on its way out of
+    // another CPU, this waits until that CPU lets go of it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    c->curproc = p;
+    p->state = RUNNING;
+    dbmsg("process %x c eip %x, p eip %x\n",p->pid, c->context.eip, p->context.eip);
+    swtchvm(&c->context, &p->context, switchsegs(p));
+
+    // The CPU went idle.  The process that gave it
+    // up is not necessarily p, and holds its lock.
+    p = c->curproc;
+    c->curproc = 0;
+    dbmsg("return to kernel\n");
+    // Leave p's page directory loaded while idle: the scheduler
+    // only touches kernel memory, which every page directory
+    // maps, and if p runs next here there is nothing to reload.
+    // p may go on to exit on another CPU and be reaped while
+    // this one is still idle on it; free_pgdir then moves this
+    // CPU to boot_pgdir with tlb_release before freeing it.
+    // A zombie's parent will free it any moment, so leave it
+    // now, which spares that IPI.
+    if(p->state == ZOMBIE){
+      c->cr3 = (paddr_t)boot_pgdir;
+      lcr3(c->cr3);
     }
-    release(&proc_table_lock);
+    release(&p->lock);
+  }
+}
 
+// Finish a switch into cp.  If the previous process switched
+// straight here from sched, it left its lock for us to release
+// now that its stack is no longer in use.
+static void
+finishswitch(void)
+{
+  struct cpu *c;
+  struct proc *prev;
+
+  c = mycpu();
+  if((prev = c->prev) != 0){
+    c->prev = 0;
+    release(&prev->lock);
   }
 }
 
-// Enter scheduler.  Must already hold proc_table_lock
-// and have changed curproc[cpu()]->state.
+// Give the CPU to the next runnable process.  Must hold
+// only cp->lock and have changed cp->state.
+// Switches directly to the process at the head of the run
+// queue, and only enters the scheduler if there is none.
 void
 sched(void)
 {
+  struct cpu *c;
+  struct proc *prev, *next;
+  int intena;
+
   if(read_eflags()&FL_IF)
     panic("sched interruptible");
   if(cp->state == RUNNING)
     panic("sched running");
-  if(!holding(&proc_table_lock))
-    panic("sched proc_table_lock");
-  if(cpus[cpu()].ncli != 1)
+  if(!holding(&cp->lock))
+    panic("sched proc lock");
+  if(mycpu()->ncli != 1)
     panic("sched locks");
+  rcu_qs();
+
+  c = mycpu();
+  prev = c->curproc;
+  intena = c->intena;
+
+  next = runq_get();
+  if(next == prev){
+    // Yielding with nothing else to run.
+    prev->state = RUNNING;
+    return;
+  }
+  // Another CPU may still be switching next out, holding its
+  // lock while it waits for a lock of ours; don't wait for it.
+  if(next && !tryacquire(&next->lock)){
+    runq_push(next);
+    next = 0;
+  }
+
+  if(next == 0){
+    dbmsg("in sched:proc %x c eip %x, p eip %x\n",prev->pid, prev->context.eip, c->context.eip);
+    swtch(&prev->context, &c->context);
+  } else {
+    if(next->state != RUNNABLE)
+      panic("sched next");
+    c->prev = prev;
+    c->curproc = next;
+    next->state = RUNNING;
+    c->ndirect++;
+    swtchvm(&prev->context, &next->context, switchsegs(next));
+  }
 
-  dbmsg("in sched:proc %x c eip %x, p eip %x\n",cp - proc, cp->context.eip, cpus[cpu()].context.eip);
-  swtch(&cp->context, &cpus[cpu()].context);
+  // Running again, maybe on a different CPU.
+  finishswitch();
+  mycpu()->intena = intena;
 }
 
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
-  acquire(&proc_table_lock);
-  cp->state = RUNNABLE;
+  acquire(&cp->lock);
+  makerunnable(cp);
   sched();
-  release(&proc_table_lock);
+  release(&cp->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
-// will swtch here.  "Return" to user space.
+// or sched() will swtch here.  "Return" to user space.
 void
 forkret(void)
 {
-  // Still holding proc_table_lock from scheduler.
-  release(&proc_table_lock);
+  finishswitch();
+
+  // Still holding cp->lock from scheduler or sched.
+  release(&cp->lock);
 
   // Jump into assembly, never to return.
   forkret1(cp->tf);
 }
 
+// First code run by a kernel thread, on its own stack.
+static void
+kthreadstart(void (*fn)(void))
+{
+  finishswitch();
+
+  // Still holding cp->lock from scheduler or sched.
+  release(&cp->lock);
+  fn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread running fn, which must not return.
+// A kernel thread is a process that never enters user space:
+// it has a kernel stack and a page directory with only the
+// kernel's mappings, and no parent, files or memory.
+struct proc*
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  uint *sp;
+
+  if((p = copyproc(0)) == 0)
+    panic("kthread");
+  p->sz = 0;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  // Call kthreadstart(fn), with a fake return pc.  The frame
+  // is built through the stack's kernel address, p->k, but the
+  // thread runs on its mapping below KSTACKTOP, p->kstack, so
+  // that the guard page catches an overflow.  swtchvm loads
+  // p's page directory before it touches the new stack.
+  sp = (uint*)(p->k + KSTACKSIZE);
+  *--sp = (uint)fn;
+  *--sp = 0xffffffff;
+  p->context.esp = (uint)p->kstack + ((uint)sp - (uint)p->k);
+  p->context.eip = (uint)kthreadstart;
+  setrunnable(p);
+  return p;
+}
+
+// Is no process waiting for a CPU?  A racy hint, for work
+// that should only soak up idle time.
+int
+runq_empty(void)
+{
+  return runq.head == 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when reawakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
+  struct sleepq *sq;
+
   if(cp == 0)
     panic("sleep");
 
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire proc_table_lock in order to
-  // change p->state and then call sched.
-  // Once we hold proc_table_lock, we can be
+  // Must acquire chan's sleep queue lock in order to
+  // queue ourselves.  Once we hold it, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup runs with proc_table_lock locked),
+  // (wakeup runs with the sleep queue locked),
   // so it's okay to release lk.
-  if(lk != &proc_table_lock){
-    acquire(&proc_table_lock);
-    release(lk);
-  }
+  sq = SQHASH(chan);
+  acquire(&sq->lock);
+  release(lk);
 
   // Go to sleep.
+  acquire(&cp->lock);
   cp->chan = chan;
   cp->state = SLEEPING;
+  LIST_INSERT_HEAD(&sq->procs, cp, qlink);
+  release(&sq->lock);
   sched();
 
   // Tidy up.
   cp->chan = 0;
+  release(&cp->lock);
 
   // Reacquire original lock.
-  if(lk != &proc_table_lock){
-    release(&proc_table_lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
-// Proc_table_lock must be held.
-static void
-wakeup1(void *chan)
+void
+wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *sq;
+  struct proc *p, *np;
 
-  for(p = proc; p < &proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  sq = SQHASH(chan);
+  acquire(&sq->lock);
+  for(p = LIST_FIRST(&sq->procs); p != 0; p = np){
+    np = LIST_NEXT(p, qlink);
+    if(p->chan == chan){
+      acquire(&p->lock);
+      LIST_REMOVE(p, qlink);
+      makerunnable(p);
+      release(&p->lock);
+    }
+  }
+  release(&sq->lock);
 }
 
-// Wake up all processes sleeping on chan.
+// Sleep on wait queue wq, which the caller's lock lk guards.
+// Unlike sleep, the process waits on wq itself, in FIFO order,
+// and only wakeone(wq) wakes it: it has no chan, so neither
+// wakeup nor kill will.
 void
-wakeup(void *chan)
+sleepon(struct waitq *wq, struct spinlock *lk)
+{
+  if(cp == 0)
+    panic("sleepon");
+
+  // lk plays the part of the sleep queue lock:
+  // wakeone runs with it held.
+  acquire(&cp->lock);
+  cp->chan = 0;
+  cp->state = SLEEPING;
+  cp->rqnext = 0;
+  if(wq->tail)
+    wq->tail->rqnext = cp;
+  else
+    wq->head = cp;
+  wq->tail = cp;
+  release(lk);
+  sched();
+  release(&cp->lock);
+
+  acquire(lk);
+}
+
+// Wake the process that has waited longest on wq.
+// Caller must hold the lock guarding wq.
+void
+wakeone(struct waitq *wq)
 {
-  acquire(&proc_table_lock);
-  wakeup1(chan);
-  release(&proc_table_lock);
+  struct proc *p;
+
+  if((p = wq->head) == 0)
+    return;
+  wq->head = p->rqnext;
+  if(wq->head == 0)
+    wq->tail = 0;
+  acquire(&p->lock);
+  makerunnable(p);
+  release(&p->lock);
+}
+
+// Wake p if it is still asleep on chan.
+static void
+wakeproc(struct proc *p, void *chan)
+{
+  struct sleepq *sq;
+
+  sq = SQHASH(chan);
+  acquire(&sq->lock);
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan){
+    LIST_REMOVE(p, qlink);
+    makerunnable(p);
+  }
+  release(&p->lock);
+  release(&sq->lock);
 }
 
 // Kill the process with the given pid.
@@ -423,20 +988,32 @@ int
 kill(int pid)
 {
   struct proc *p;
+  void *chan;
 
-  acquire(&proc_table_lock);
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->pid == pid){
-      p->killed = 1;
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&proc_table_lock);
-      return 0;
-    }
+  rcu_read_lock();
+  LIST_FOREACH(p, PIDHASH(pid), hlink){
+    if(p->pid == pid)
+      break;
   }
-  release(&proc_table_lock);
-  return -1;
+  if(p == 0){
+    rcu_read_unlock();
+    return -1;
+  }
+  acquire(&p->lock);
+  rcu_read_unlock();
+  // p may have exited since we found it.
+  if(p->pid != pid){
+    release(&p->lock);
+    return -1;
+  }
+  p->killed = 1;
+  chan = p->state == SLEEPING ? p->chan : 0;
+  release(&p->lock);
+
+  // Wake process from sleep if necessary.
+  if(chan)
+    wakeproc(p, chan);
+  return 0;
 }
 
 // Exit the current process.  Does not return.
@@ -462,23 +1039,27 @@ exit(void)
   iput(cp->cwd);
   cp->cwd = 0;
 
-  acquire(&proc_table_lock);
+  acquire(&proc_tree_lock);
 
   // Parent might be sleeping in wait().
-  wakeup1(cp->parent);
+  wakeup(cp->parent);
 
   // Pass abandoned children to init.
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->parent == cp){
-      p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
-    }
+  while((p = LIST_FIRST(&cp->children)) != 0){
+    LIST_REMOVE(p, sibling);
+    p->parent = initproc;
+    LIST_INSERT_HEAD(&initproc->children, p, sibling);
+    if(p->state == ZOMBIE)
+      wakeup(initproc);
   }
 
   // Jump into the scheduler, never to return.
+  // Our parent may reap us as soon as proc_tree_lock is
+  // released, but not before the scheduler lets go of cp->lock.
+  acquire(&cp->lock);
   cp->killed = 0;
   cp->state = ZOMBIE;
+  release(&proc_tree_lock);
   //cprintf("proc %x exit\n",cp - proc);
   sched();
   panic("zombie exit");
@@ -490,43 +1071,51 @@ int
 wait(void)
 {
   struct proc *p;
-  int i, havekids, pid;
+  pde_t *pgdir;
+  int pid;
 
-  acquire(&proc_table_lock);
+  acquire(&proc_tree_lock);
   for(;;){
-    // Scan through table looking for zombie children.
-    havekids = 0;
-    for(i = 0; i < NPROC; i++){
-      p = &proc[i];
-      if(p->state == UNUSED)
+    // Scan through our children looking for zombies.
+    // A child's ZOMBIE state is set with proc_tree_lock
+    // held, so it can be checked here without p->lock.
+    LIST_FOREACH(p, &cp->children, sibling){
+      if(p->state != ZOMBIE)
         continue;
-      if(p->parent == cp){
-        if(p->state == ZOMBIE){
-          // Found one.
-          //kfree(p->mem, p->sz);
-          //kfree(p->kstack, KSTACKSIZE);
-          //do_unmap(p->vm.pgdir, (vaddr_t)p->kstack, KSTACKSIZE);
-          unmap_userspace(p->vm.pgdir);
-          pid = p->pid;
-          p->state = UNUSED;
-          p->pid = 0;
-          p->parent = 0;
-          p->name[0] = 0;
-          release(&proc_table_lock);
-          return pid;
-        }
-        havekids = 1;
-      }
+      // Found one.  Wait for it to be switched out
+      // of the CPU it exited on.
+      acquire(&p->lock);
+      release(&p->lock);
+      //kfree(p->mem, p->sz);
+      //kfree(p->kstack, KSTACKSIZE);
+      //do_unmap(p->vm.pgdir, (vaddr_t)p->kstack, KSTACKSIZE);
+      pid = p->pid;
+      LIST_REMOVE(p, sibling);
+      p->parent = 0;
+      release(&proc_tree_lock);
+      // Free the kernel stack and the address space.
+      // Unmapping may wait for other CPUs; not with a spin lock.
+      // procmem reads the page directory's counts under p->lock,
+      // so take it away there before freeing it.
+      kstack_free(p->k, p->kpt);
+      acquire(&p->lock);
+      pgdir = p->vm.pgdir;
+      p->vm.pgdir = 0;
+      release(&p->lock);
+      free_pgdir(pgdir);
+      p->kstack = 0;
+      freeproc(p);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || cp->killed){
-      release(&proc_table_lock);
+    if(LIST_EMPTY(&cp->children) || cp->killed){
+      release(&proc_tree_lock);
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-    sleep(cp, &proc_table_lock);
+    // Wait for children to exit.  (See wakeup call in exit.)
+    sleep(cp, &proc_tree_lock);
   }
 }
 
@@ -546,11 +1135,14 @@ procdump(void)
   };
   int i, j;
   struct proc *p;
+  struct cpu *c;
   char *state;
-  uint pc[10];
+  uint pc[10], n;
+  unsigned long long cyc;
+  pde_t *pgdir;
   
-  for(i = 0; i < NPROC; i++){
-    p = &proc[i];
+  rcu_read_lock();
+  for(p = allproc; p != 0; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -558,6 +1150,13 @@ procdump(void)
     else
       state = "???";
     cprintf("%d %s %s", p->pid, state, p->name);
+    // The page directory may be on its way to being freed
+    // (see procmem); skip the count rather than wait.
+    if(tryacquire(&p->lock)){
+      if((pgdir = p->vm.pgdir) != 0)
+        cprintf(" rss %d", pgdir_rss(pgdir));
+      release(&p->lock);
+    }
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context.ebp+2, pc);
       for(j=0; j<10 && pc[j] != 0; j++)
@@ -565,5 +1164,54 @@ procdump(void)
     }
     cprintf("\n");
   }
+  rcu_read_unlock();
+  for(i = 0; i < ncpu; i++){
+    c = &cpus[i];
+    // No 64-bit divide in the kernel: scale both down instead.
+    cyc = c->swcycles;
+    n = c->nswitch;
+    while(cyc > 0xffffffff){
+      cyc >>= 1;
+      n >>= 1;
+    }
+    cprintf("cpu%d: %d switches, %d direct, %d cr3 loads, %d cycles/switch\n",
+            i, c->nswitch, c->ndirect, c->ncr3, n ? (uint)cyc / n : 0);
+  }
+  kallocdump();
+}
+
+// Fill pm with the memory use of up to n processes.
+// Returns the number filled in.  Does not sleep.
+// The counts are read under p->lock, which wait holds to
+// take the page directory away before freeing it.
+int
+procmem(struct procmem *pm, int n)
+{
+  struct proc *p;
+  pde_t *pgdir;
+  int i;
+
+  i = 0;
+  rcu_read_lock();
+  for(p = allproc; p != 0 && i < n; p = p->allnext){
+    if(p->state == UNUSED)
+      continue;
+    pm[i].pid = p->pid;
+    pm[i].sz = p->sz;
+    // The page directory goes when a zombie is reaped.
+    acquire(&p->lock);
+    if((pgdir = p->vm.pgdir) != 0){
+      pm[i].rss = pgdir_rss(pgdir);
+      pm[i].ptabs = pgdir_ptabs(pgdir);
+    } else
+      pm[i].rss = pm[i].ptabs = 0;
+    release(&p->lock);
+    pm[i].rsslimit = p->rsslimit;
+    pm[i].nfault = p->nfault;
+    safestrcpy(pm[i].name, p->name, sizeof(pm[i].name));
+    i++;
+  }
+  rcu_read_unlock();
+  return i;
 }
 
@@ -1,5 +1,7 @@
 #include "spinlock.h"
 #include "types.h"
+#include "queue.h"
+#include "rcu.h"
 
 // Segments in proc->gdt
 #define SEG_KCODE 1  // kernel code
@@ -7,7 +9,8 @@
 #define SEG_UCODE 3
 #define SEG_UDATA 4
 #define SEG_TSS   5  // this process's task state
-#define NSEGS     6
+#define SEG_KCPU  6  // per-CPU data, selected by %gs
+#define NSEGS     7
 
 // Saved registers for kernel context switches.
 // Don't need to save all the %fs etc. segment registers,
@@ -39,12 +42,20 @@ struct proc_vm {
   vaddr_t start_stack;      // Initial address of user mode stack
 };
 
+typedef LIST_HEAD(proc_list, proc) proc_list_t;
+
 // Per-process state
+//
+// p->lock protects state, chan, killed and the run queue and
+// sleep queue links.  proc_tree_lock protects parent, children
+// and sibling.
 struct proc {
+  struct spinlock lock;     // Protects the process's scheduling state
   char *mem;                // Start of process memory (kernel address)
   uint sz;                  // Size of process memory (bytes)
   char *kstack;             // Bottom of kernel stack for this process
   char *k;
+  pte_t *kpt;               // Page table that maps kstack
   enum proc_state state;    // Process state
   int pid;                  // Process ID
   struct proc *parent;      // Parent process
@@ -55,7 +66,17 @@ struct proc {
   struct context context;   // Switch here to run process
   struct trapframe *tf;     // Trap frame for current interrupt
   struct proc_vm vm;        // Information about the process address space
+  int faultaround;          // Pages to map per page fault, a power of 2
+  uint nfault;              // Page faults taken
+  uint rsslimit;            // Most pages it may fault in (RLIMIT_RSS)
   char name[16];            // Process name (debugging)
+  struct proc *rqnext;      // Next process on the run queue
+  LIST_ENTRY(proc) qlink;   // Sleep queue, or free list if UNUSED
+  proc_list_t children;     // Processes whose parent is this one
+  LIST_ENTRY(proc) sibling; // Link in parent's children list
+  LIST_ENTRY(proc) hlink;   // Link in pid hash chain
+  struct proc *allnext;     // Next in list of all procs, used or not
+  struct rcu_head rcu;      // Deferred return to the free list
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -66,20 +87,53 @@ struct proc {
 
 // Per-CPU state
 struct cpu {
+  // The SEG_KCPU segment starts at self, so these
+  // two are at %gs:0 and %gs:4.  See mycpu().
+  struct cpu *self;           // This struct cpu
+  struct proc *curproc;       // Process currently running.
+  int id;                     // Index in cpus[]
   uchar apicid;               // Local APIC ID
   paddr_t cr3;                // cr3 register
-  struct proc *curproc;       // Process currently running.
+  uint usz;                   // Size of the user segments in gdt
+  struct proc *prev;          // Process that switched directly to curproc
   struct context context;     // Switch here to enter scheduler
   struct taskstate ts;        // Used by x86 to find stack for interrupt
   struct segdesc gdt[NSEGS];  // x86 global descriptor table
   volatile uint booted;        // Has the CPU started?
   int ncli;                   // Depth of pushcli nesting.
   int intena;                 // Were interrupts enabled before pushcli? 
+
+  // Context switch statistics, shown by procdump.
+  uint nswitch;               // Switches into a process
+  uint ncr3;                  // ... of which had to reload cr3
+  uint ndirect;               // ... of which came straight from another
+  unsigned long long swcycles; // Cycles spent in switchsegs
 };
 
 extern struct cpu cpus[NCPU];
 extern int ncpu;
 
+// The running CPU's struct cpu, and the process it is running,
+// each read with one load through %gs (see seginit).  Volatile,
+// because a process that sleeps may wake up on another CPU.
+static inline struct cpu*
+mycpu(void)
+{
+  struct cpu *c;
+
+  asm volatile("movl %%gs:0, %0" : "=r" (c));
+  return c;
+}
+
+static inline struct proc*
+curproc(void)
+{
+  struct proc *p;
+
+  asm volatile("movl %%gs:4, %0" : "=r" (p));
+  return p;
+}
+
 // "cp" is a short alias for curproc().
 // It gets used enough to make this worthwhile.
 #define cp curproc()
@@ -0,0 +1,10 @@
+// Memory use of a process, as reported by procmem().
+struct procmem {
+  int pid;
+  uint sz;        // Size of its memory, in bytes
+  uint rss;       // Pages resident
+  uint ptabs;     // Page tables
+  uint rsslimit;  // Most pages it may have resident
+  uint nfault;    // Page faults taken
+  char name[16];
+};
@@ -0,0 +1,42 @@
+// List processes with their memory use, largest
+// resident set last, so that it is easy to spot.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "syscall.h"
+#include "procmem.h"
+
+#define NPM 64
+
+struct procmem pm[NPM];
+
+int
+main(void)
+{
+  struct procmem t;
+  int i, j, n;
+
+  n = procmem(pm, NPM);
+  if(n < 0){
+    printf(2, "ps: procmem failed\n");
+    exit();
+  }
+  for(i = 1; i < n; i++)
+    for(j = i; j > 0 && pm[j-1].rss > pm[j].rss; j--){
+      t = pm[j];
+      pm[j] = pm[j-1];
+      pm[j-1] = t;
+    }
+  printf(1, "pid\tkbytes\trss\tptabs\tfaults\tlimit\tname\n");
+  for(i = 0; i < n; i++){
+    printf(1, "%d\t%d\t%d\t%d\t%d\t", pm[i].pid, pm[i].sz / 1024,
+           pm[i].rss, pm[i].ptabs, pm[i].nfault);
+    if(pm[i].rsslimit == RLIM_INFINITY)
+      printf(1, "-");
+    else
+      printf(1, "%d", pm[i].rsslimit);
+    printf(1, "\t%s\n", pm[i].name);
+  }
+  exit();
+}
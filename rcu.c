@@ -0,0 +1,130 @@
+// Read-copy-update: quiescent-state tracking and deferred
+// callbacks.  See rcu.h.
+//
+// Each CPU counts its quiescent states.  A grace period starts
+// by recording every CPU's count, and is over when every CPU's
+// count has moved on.  Callbacks queued by call_rcu wait in
+// "next" until a grace period starts, in "cur" during it, and
+// are run by whichever CPU's timer tick notices it has ended.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "rcu.h"
+
+static volatile uint qscount[NCPU];
+
+static struct {
+  struct spinlock lock;
+  struct rcu_head *next;       // Waiting for a grace period to start
+  struct rcu_head **nexttail;
+  struct rcu_head *cur;        // Waiting for this one to end
+  uint snap[NCPU];             // qscount when it started
+} rcu;
+
+void
+rcu_init(void)
+{
+  initlock(&rcu.lock, "rcu");
+  rcu.nexttail = &rcu.next;
+}
+
+// Note that this CPU is in a quiescent state: it holds no
+// references obtained inside an RCU read section.
+void
+rcu_qs(void)
+{
+  qscount[mycpu()->id]++;
+}
+
+// Run func(head) after a grace period.
+void
+call_rcu(struct rcu_head *head, void (*func)(struct rcu_head*))
+{
+  head->func = func;
+  head->next = 0;
+  acquire(&rcu.lock);
+  *rcu.nexttail = head;
+  rcu.nexttail = &head->next;
+  release(&rcu.lock);
+}
+
+// Has every running CPU passed a quiescent state since
+// the current grace period started?
+static int
+gpdone(void)
+{
+  int i;
+
+  for(i = 0; i < ncpu; i++)
+    if(cpus[i].booted && qscount[i] == rcu.snap[i])
+      return 0;
+  return 1;
+}
+
+// Advance grace periods and run the callbacks whose grace
+// period has ended.  Called from the timer interrupt on
+// every CPU.
+void
+rcu_poll(void)
+{
+  struct rcu_head *done, *h;
+  int i;
+
+  if(rcu.cur == 0 && rcu.next == 0)
+    return;
+
+  acquire(&rcu.lock);
+  done = 0;
+  if(rcu.cur && gpdone()){
+    done = rcu.cur;
+    rcu.cur = 0;
+  }
+  if(rcu.cur == 0 && rcu.next){
+    rcu.cur = rcu.next;
+    rcu.next = 0;
+    rcu.nexttail = &rcu.next;
+    for(i = 0; i < ncpu; i++)
+      rcu.snap[i] = qscount[i];
+  }
+  release(&rcu.lock);
+
+  while((h = done) != 0){
+    done = h->next;
+    h->func(h);
+  }
+}
+
+struct rcu_sync {
+  struct rcu_head head;
+  int done;
+};
+
+static void
+rcu_wake(struct rcu_head *head)
+{
+  struct rcu_sync *s = (struct rcu_sync*)head;
+
+  acquire(&rcu.lock);
+  s->done = 1;
+  wakeup(s);
+  release(&rcu.lock);
+}
+
+// Wait for a full grace period to pass.
+// Must be called from a process, holding no locks.
+void
+synchronize_rcu(void)
+{
+  struct rcu_sync s;
+
+  s.done = 0;
+  call_rcu(&s.head, rcu_wake);
+  acquire(&rcu.lock);
+  while(!s.done)
+    sleep(&s, &rcu.lock);
+  release(&rcu.lock);
+}
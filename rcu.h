@@ -0,0 +1,25 @@
+#ifndef _RCU_H_
+#define _RCU_H_
+
+// Read-copy-update.
+//
+// Readers bracket a lookup with rcu_read_lock/rcu_read_unlock,
+// take no lock and write nothing shared.  Updaters serialize
+// among themselves with an ordinary lock, unlink an object so
+// that new readers cannot find it, and hand it to call_rcu.
+// The callback runs once every CPU has passed through a
+// quiescent state -- a context switch, the idle loop, or a
+// timer tick in user mode -- so no reader can still be looking
+// at the object, and it can be freed or reused.
+//
+// A read section runs with interrupts off and must not sleep.
+
+struct rcu_head {
+  struct rcu_head *next;
+  void (*func)(struct rcu_head*);
+};
+
+#define rcu_read_lock()   pushcli()
+#define rcu_read_unlock() popcli()
+
+#endif
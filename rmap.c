@@ -0,0 +1,200 @@
+// Reverse map: from a physical page to the PTEs that map it.
+//
+// Every user mapping of a page is recorded as a (page directory,
+// virtual address) pair, from which get_pte finds the PTE.  The
+// first mapping lives in the page's struct Page, so the common
+// case, a page mapped once, costs no allocation; further
+// mappings go on a chain of struct rmap hanging off the page.
+// Chain entries are carved out of whole pages kept in a pool.
+//
+// The fixed cost is three words per page frame; rmapdump
+// prints it, with the chains, as bytes per frame.
+//
+// insert_page records a mapping before installing its PTE, and
+// put_pte drops it after the PTE is gone, so at any time the map
+// holds every mapping counted in the page's mapcount, and maybe
+// some that are on their way in or out.  A walker must check
+// that each PTE it finds really maps the page.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "pmap.h"
+#include "buddy.h"
+#include "errorno.h"
+
+struct rmap {
+  pde_t *pgdir;
+  vaddr_t va;
+  struct rmap *next;
+};
+
+// Guards the reverse map of every page, and the entry pool.
+struct spinlock rmap_lock;
+
+static struct {
+  struct rmap *free;   // Unused chain entries
+  uint pages;          // Pages given to the pool
+  uint chained;        // Chain entries in use
+  uint mapped;         // Mappings recorded in total
+} rpool;
+
+void
+rmap_init(void)
+{
+  initlock(&rmap_lock, "rmap");
+}
+
+// Carve the page v into chain entries.  Caller holds rmap_lock.
+static void
+rgrow(char *v)
+{
+  struct rmap *r;
+  int i;
+
+  r = (struct rmap*)v;
+  for(i = 0; i < PAGE / sizeof(*r); i++){
+    r[i].next = rpool.free;
+    rpool.free = &r[i];
+  }
+  rpool.pages++;
+}
+
+// Get a chain entry, or 0 if the pool is empty.
+// Caller holds rmap_lock.
+static struct rmap*
+ralloc(void)
+{
+  struct rmap *r;
+
+  if((r = rpool.free) == 0)
+    return 0;
+  rpool.free = r->next;
+  rpool.chained++;
+  return r;
+}
+
+static void
+rfree(struct rmap *r)
+{
+  r->next = rpool.free;
+  rpool.free = r;
+  rpool.chained--;
+}
+
+// Record that pgdir maps p at va.
+// Returns 0, or -E_NO_MEM if there is no room in the chain.
+int
+rmap_add(struct Page *p, pde_t *pgdir, vaddr_t va)
+{
+  struct rmap *r;
+  char *v;
+
+  acquire(&rmap_lock);
+  if(p->rmap_pgdir == 0){
+    p->rmap_pgdir = pgdir;
+    p->rmap_va = va;
+  } else {
+    while((r = ralloc()) == 0){
+      // Grow the pool with rmap_lock let go: kalloc may
+      // wake kswapd, and rmap_lock is taken under lru.lock.
+      release(&rmap_lock);
+      if((v = kalloc(PAGE)) == 0)
+        return -E_NO_MEM;
+      acquire(&rmap_lock);
+      rgrow(v);
+    }
+    if(p->rmap_pgdir == 0){
+      // The first slot was freed meanwhile.
+      rfree(r);
+      p->rmap_pgdir = pgdir;
+      p->rmap_va = va;
+      rpool.mapped++;
+      release(&rmap_lock);
+      return 0;
+    }
+    r->pgdir = pgdir;
+    r->va = va;
+    r->next = p->rmap_next;
+    p->rmap_next = r;
+  }
+  rpool.mapped++;
+  release(&rmap_lock);
+  return 0;
+}
+
+// Forget that pgdir maps p at va.
+void
+rmap_del(struct Page *p, pde_t *pgdir, vaddr_t va)
+{
+  struct rmap *r, **rp;
+
+  acquire(&rmap_lock);
+  if(p->rmap_pgdir == pgdir && p->rmap_va == va){
+    // Pull the first chained mapping into the page.
+    if((r = p->rmap_next) != 0){
+      p->rmap_pgdir = r->pgdir;
+      p->rmap_va = r->va;
+      p->rmap_next = r->next;
+      rfree(r);
+    } else
+      p->rmap_pgdir = 0;
+    rpool.mapped--;
+  } else {
+    for(rp = &p->rmap_next; (r = *rp) != 0; rp = &r->next){
+      if(r->pgdir == pgdir && r->va == va){
+        *rp = r->next;
+        rfree(r);
+        rpool.mapped--;
+        break;
+      }
+    }
+  }
+  release(&rmap_lock);
+}
+
+// Call fn(p, pgdir, va, arg) for each recorded mapping of p,
+// until fn returns non-zero; return what it returned, or 0.
+// Caller holds rmap_lock, so fn must not add or drop mappings.
+int
+rmap_walk(struct Page *p, int (*fn)(struct Page*, pde_t*, vaddr_t, void*), void *arg)
+{
+  struct rmap *r;
+  int ret;
+
+  if(p->rmap_pgdir == 0)
+    return 0;
+  if((ret = fn(p, p->rmap_pgdir, p->rmap_va, arg)) != 0)
+    return ret;
+  for(r = p->rmap_next; r; r = r->next)
+    if((ret = fn(p, r->pgdir, r->va, arg)) != 0)
+      return ret;
+  return 0;
+}
+
+// Hand the mappings of old over to new, whose PTEs the caller
+// is about to point at new.  Caller holds rmap_lock.
+void
+rmap_move(struct Page *old, struct Page *new)
+{
+  new->rmap_pgdir = old->rmap_pgdir;
+  new->rmap_va = old->rmap_va;
+  new->rmap_next = old->rmap_next;
+  old->rmap_pgdir = 0;
+  old->rmap_next = 0;
+}
+
+void
+rmapdump(void)
+{
+  uint frames, bytes;
+
+  frames = buddy_frames();
+  acquire(&rmap_lock);
+  bytes = (sizeof(pde_t*) + sizeof(vaddr_t) + sizeof(struct rmap*)) * frames;
+  bytes += rpool.pages * PAGE;
+  cprintf("rmap: %d mappings, %d chained, %d pool pages, %d bytes/frame\n",
+          rpool.mapped, rpool.chained, rpool.pages, frames ? bytes / frames : 0);
+  release(&rmap_lock);
+}
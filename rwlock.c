@@ -0,0 +1,124 @@
+// Reader-writer spin locks and sequence locks, for data that
+// is read on every CPU far more often than it is written.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "rwlock.h"
+
+void
+initrwlock(struct rwlock *rw, char *name)
+{
+  rw->name = name;
+  rw->cnt = 0;
+  rw->cpu = 0xffffffff;
+}
+
+// Acquire rw shared with other readers.
+void
+acquire_read(struct rwlock *rw)
+{
+  uint v;
+
+  pushcli();
+  if(rw->cpu == cpu() + 10)
+    panic("acquire_read");
+  for(;;){
+    v = rw->cnt;
+    if(!(v & (RW_WRITER|RW_WAITING)) && cmpxchg(&rw->cnt, v, v+1) == v)
+      break;
+    pause();
+  }
+  barrier();
+}
+
+void
+release_read(struct rwlock *rw)
+{
+  if((rw->cnt & RW_READERS) == 0)
+    panic("release_read");
+  barrier();
+  xadd(&rw->cnt, -1);
+  popcli();
+}
+
+// Acquire rw exclusively.
+void
+acquire_write(struct rwlock *rw)
+{
+  uint v;
+
+  pushcli();
+  if(rw->cpu == cpu() + 10)
+    panic("acquire_write");
+  for(;;){
+    v = rw->cnt;
+    if((v & ~RW_WAITING) == 0){
+      if(cmpxchg(&rw->cnt, v, RW_WRITER) == v)
+        break;
+    } else if(!(v & RW_WAITING))
+      cmpxchg(&rw->cnt, v, v | RW_WAITING);
+    pause();
+  }
+  barrier();
+  rw->cpu = cpu() + 10;
+}
+
+void
+release_write(struct rwlock *rw)
+{
+  if(!(rw->cnt & RW_WRITER) || rw->cpu != cpu() + 10)
+    panic("release_write");
+  rw->cpu = 0xffffffff;
+  barrier();
+  xadd(&rw->cnt, -RW_WRITER);
+  popcli();
+}
+
+void
+initseqlock(struct seqlock *sl, char *name)
+{
+  sl->seq = 0;
+  initlock(&sl->lock, name);
+}
+
+void
+write_seqlock(struct seqlock *sl)
+{
+  acquire(&sl->lock);
+  sl->seq++;
+  barrier();
+}
+
+void
+write_sequnlock(struct seqlock *sl)
+{
+  barrier();
+  sl->seq++;
+  release(&sl->lock);
+}
+
+// Start a read section: wait out any writer and return
+// the sequence number to hand to read_seqretry.
+uint
+read_seqbegin(struct seqlock *sl)
+{
+  uint seq;
+
+  while((seq = *(volatile uint*)&sl->seq) & 1)
+    pause();
+  barrier();
+  return seq;
+}
+
+// End a read section.  Returns 1 if a writer got in since
+// read_seqbegin returned seq, in which case the data read
+// may be inconsistent and the read must be done again.
+int
+read_seqretry(struct seqlock *sl, uint seq)
+{
+  barrier();
+  return *(volatile uint*)&sl->seq != seq;
+}
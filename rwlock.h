@@ -0,0 +1,28 @@
+#ifndef _RWLOCK_H_
+#define _RWLOCK_H_
+#include "spinlock.h"
+
+// Reader-writer spin lock: any number of readers, or one writer.
+// A waiting writer holds off new readers, so that a steady stream
+// of readers cannot starve it.  A CPU must not take a read lock
+// it already holds for reading: a writer may be waiting between.
+#define RW_WRITER   0x80000000  // Held by a writer
+#define RW_WAITING  0x40000000  // A writer is waiting
+#define RW_READERS  0x3fffffff  // Number of readers holding it
+
+struct rwlock {
+  uint cnt;      // RW_WRITER, RW_WAITING and the reader count
+  char *name;    // Name of lock.
+  int cpu;       // The cpu holding it for writing, plus 10.
+};
+
+// Sequence lock.  Writers serialize on a spin lock and bump seq
+// before and after an update, so seq is odd while one is under
+// way.  Readers take no lock at all: they copy the data out and
+// try again if seq changed meanwhile.  Good for small, read-mostly
+// data that can be copied without following pointers.
+struct seqlock {
+  uint seq;
+  struct spinlock lock;
+};
+#endif
@@ -0,0 +1,102 @@
+// Sleeping locks, for critical sections that may be long or
+// may themselves sleep, such as disk I/O on a buffer or inode.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+
+// How many times to spin waiting for a holder that is running
+// on another CPU before giving up and going to sleep.
+#define SLEEPLOCK_SPIN 4096
+
+void
+initsleeplock(struct sleeplock *sl, char *name)
+{
+  initlock(&sl->lk, "sleep lock");
+  sl->name = name;
+  sl->locked = 0;
+  sl->owner = 0;
+  sl->waiters.head = 0;
+  sl->waiters.tail = 0;
+}
+
+// Is the holder of sl running on some CPU right now?
+static int
+ownerrunning(struct sleeplock *sl)
+{
+  struct proc *p;
+
+  // Procs are never freed, so p stays valid even if
+  // the lock changes hands meanwhile.
+  p = sl->owner;
+  return p != 0 && p->state == RUNNING;
+}
+
+void
+acquire_sleep(struct sleeplock *sl)
+{
+  int i, spun;
+
+  acquire(&sl->lk);
+  if(sl->locked && sl->owner == cp)
+    panic("acquire_sleep");
+  spun = 0;
+  while(sl->locked){
+    // A running holder is likely to release the lock
+    // sooner than a sleep and wakeup would take.
+    if(!spun && ownerrunning(sl)){
+      spun = 1;
+      release(&sl->lk);
+      for(i = 0; i < SLEEPLOCK_SPIN && sl->locked && ownerrunning(sl); i++)
+        pause();
+      acquire(&sl->lk);
+      continue;
+    }
+    sleepon(&sl->waiters, &sl->lk);
+    spun = 0;
+  }
+  sl->locked = 1;
+  sl->owner = cp;
+  release(&sl->lk);
+}
+
+// Acquire sl if it is free, without waiting.
+// Returns 1 if it was acquired.
+int
+tryacquire_sleep(struct sleeplock *sl)
+{
+  int ok;
+
+  acquire(&sl->lk);
+  ok = !sl->locked;
+  if(ok){
+    sl->locked = 1;
+    sl->owner = cp;
+  }
+  release(&sl->lk);
+  return ok;
+}
+
+void
+release_sleep(struct sleeplock *sl)
+{
+  acquire(&sl->lk);
+  if(!sl->locked || sl->owner != cp)
+    panic("release_sleep");
+  sl->locked = 0;
+  sl->owner = 0;
+  wakeone(&sl->waiters);
+  release(&sl->lk);
+}
+
+// Does the current process hold sl?
+int
+holding_sleep(struct sleeplock *sl)
+{
+  return sl->locked && sl->owner == cp;
+}
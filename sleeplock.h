@@ -0,0 +1,22 @@
+#ifndef _SLEEPLOCK_H_
+#define _SLEEPLOCK_H_
+#include "spinlock.h"
+
+// Processes sleeping in FIFO order, linked through rqnext
+// (a sleeping process is never on the run queue).
+struct waitq {
+  struct proc *head;
+  struct proc *tail;
+};
+
+// Long-term lock for processes: a process that finds it held
+// spins for a while if the holder is running on another CPU,
+// and otherwise sleeps until the holder releases it.
+struct sleeplock {
+  struct spinlock lk;     // Protects the fields below
+  uint locked;            // Is the lock held?
+  struct proc *owner;     // Process holding the lock
+  struct waitq waiters;   // Processes sleeping for the lock
+  char *name;             // Name of lock.
+};
+#endif
@@ -10,12 +10,117 @@
 
 extern int use_console_lock;
 
+// Per-name lock statistics.  Locks initialized with the
+// same name (all the proc locks, all the pipe locks) share
+// one entry.  Each CPU updates only its own counters, so
+// the counters need no lock of their own.
+
+struct lockstat {
+  char *name;
+  struct {
+    uint nacquire;                // Acquisitions
+    uint ncontend;                // Acquisitions that had to wait
+    unsigned long long spin;      // Cycles spent waiting
+    unsigned long long maxhold;   // Longest hold, in cycles
+    uint maxpcs[10];              // Where that hold began
+  } cpu[NCPU];
+};
+
+static struct lockstat lockstats[NLOCKCLASS];
+static uint lockstats_busy;
+
+#if SPINLOCK == SPIN_MCS
+// MCS queue nodes.  A CPU holds or waits for few locks at
+// once, and always releases a lock on the CPU that took it,
+// so a small per-CPU pool is enough.
+#define NMCSNODE 16
+
+static struct mcsnode mcsnodes[NCPU][NMCSNODE];
+
+static struct mcsnode*
+mcsalloc(void)
+{
+  struct mcsnode *n;
+  int c;
+
+  c = mycpu()->id;
+  for(n = mcsnodes[c]; n < &mcsnodes[c][NMCSNODE]; n++){
+    if(!n->busy){
+      n->busy = 1;
+      n->next = 0;
+      n->wait = 1;
+      return n;
+    }
+  }
+  panic("mcsalloc");
+  return 0;
+}
+#endif
+
+// Index of lock's class, or -1 if the class table was full.
+int
+lockclass(struct spinlock *lock)
+{
+  if(lock->stat == 0)
+    return -1;
+  return lock->stat - lockstats;
+}
+
+// Find or make the statistics entry for locks called name.
+// Returns 0 if the table is full.
+static struct lockstat*
+lockstatfor(char *name)
+{
+  struct lockstat *s;
+
+  while(xchg(&lockstats_busy, 1) == 1)
+    ;
+  for(s = lockstats; s < &lockstats[NLOCKCLASS]; s++){
+    if(s->name == 0)
+      s->name = name;
+    if(strncmp(s->name, name, 32) == 0)
+      break;
+  }
+  xchg(&lockstats_busy, 0);
+  if(s == &lockstats[NLOCKCLASS])
+    return 0;
+  return s;
+}
+
 void
 initlock(struct spinlock *lock, char *name)
 {
   lock->name = name;
   lock->locked = 0;
+  lock->next = 0;
+  lock->owner = 0;
+  lock->tail = 0;
+  lock->node = 0;
   lock->cpu = 0xffffffff;
+  lock->stat = lockstatfor(name);
+}
+
+// Note that this CPU now holds lock, having waited
+// spin cycles for it if contended.
+static void
+acquired(struct spinlock *lock, int contended, unsigned long long spin)
+{
+  struct lockstat *s;
+  int c;
+
+  // The +10 is only so that we can tell the difference
+  // between forgetting to initialize lock->cpu
+  // and holding a lock on cpu 0.
+  c = mycpu()->id;
+  lock->cpu = c + 10;
+  if((s = lock->stat) != 0){
+    s->cpu[c].nacquire++;
+    if(contended){
+      s->cpu[c].ncontend++;
+      s->cpu[c].spin += spin;
+    }
+  }
+  lock->tstart = rdtsc();
 }
 
 // Acquire the lock.
@@ -25,32 +130,132 @@ initlock(struct spinlock *lock, char *name)
 void
 acquire(struct spinlock *lock)
 {
+  unsigned long long t0, wait;
+  int contended;
+#if SPINLOCK == SPIN_TICKET
+  uint t;
+#elif SPINLOCK == SPIN_MCS
+  struct mcsnode *n, *pred;
+#endif
+
   pushcli();
   if(holding(lock)) {
     panic("acquire");
   }
 
+  t0 = rdtsc();
+  contended = 0;
+#if SPINLOCK == SPIN_TAS
   // The xchg is atomic.
   // It also serializes, so that reads after acquire are not
   // reordered before it.  
-  while(xchg(&lock->locked, 1) == 1)
-    ;
+  while(xchg(&lock->locked, 1) == 1){
+    contended = 1;
+    pause();
+  }
+#elif SPINLOCK == SPIN_TICKET
+  // Take a ticket and wait for it to be served.
+  // Waiters get the lock in the order they arrived.
+  t = xadd(&lock->next, 1);
+  while(*(volatile uint*)&lock->owner != t){
+    contended = 1;
+    pause();
+  }
+#else
+  // Append a node to the queue and, if there was a
+  // predecessor, spin on our own node until it hands
+  // the lock on.  Only the handoff touches a shared line.
+  n = mcsalloc();
+  pred = (struct mcsnode*)xchg((uint*)&lock->tail, (uint)n);
+  if(pred){
+    contended = 1;
+    pred->next = n;
+    while(n->wait)
+      pause();
+  }
+  lock->node = n;
+#endif
+  barrier();
 
   // Record info about lock acquisition for debugging.
-  // The +10 is only so that we can tell the difference
-  // between forgetting to initialize lock->cpu
-  // and holding a lock on cpu 0.
-  lock->cpu = cpu() + 10;
+  wait = rdtsc() - t0;
+  acquired(lock, contended, wait);
+  getcallerpcs(&lock, lock->pcs);
+#ifdef LOCKDEP
+  lockdep_acquire(lock, 0, wait);
+#endif
+}
+
+// Try to acquire the lock without spinning.
+// Returns 1 if the lock was acquired, 0 if it is held,
+// whether by another CPU or by this one.
+int
+tryacquire(struct spinlock *lock)
+{
+#if SPINLOCK == SPIN_TICKET
+  uint t;
+#elif SPINLOCK == SPIN_MCS
+  struct mcsnode *n;
+#endif
+
+  pushcli();
+#if SPINLOCK == SPIN_TAS
+  if(xchg(&lock->locked, 1) == 1){
+    popcli();
+    return 0;
+  }
+#elif SPINLOCK == SPIN_TICKET
+  // Free if no ticket is outstanding; the cmpxchg fails
+  // if someone else took a ticket after we looked.
+  t = lock->owner;
+  if(lock->next != t || cmpxchg(&lock->next, t, t+1) != t){
+    popcli();
+    return 0;
+  }
+#else
+  n = mcsalloc();
+  if(lock->tail != 0 || cmpxchg((uint*)&lock->tail, 0, (uint)n) != 0){
+    n->busy = 0;
+    popcli();
+    return 0;
+  }
+  lock->node = n;
+#endif
+  barrier();
+  acquired(lock, 0, 0);
   getcallerpcs(&lock, lock->pcs);
+#ifdef LOCKDEP
+  lockdep_acquire(lock, 1, 0);
+#endif
+  return 1;
 }
 
 // Release the lock.
 void
 release(struct spinlock *lock)
 {
+  struct lockstat *s;
+  unsigned long long hold;
+  int c;
+#if SPINLOCK == SPIN_MCS
+  struct mcsnode *n;
+#endif
+
   if(!holding(lock))
     panic("release");
 
+  hold = rdtsc() - lock->tstart;
+#ifdef LOCKDEP
+  lockdep_release(lock, hold);
+#endif
+  if((s = lock->stat) != 0){
+    c = mycpu()->id;
+    if(hold > s->cpu[c].maxhold){
+      s->cpu[c].maxhold = hold;
+      memmove(s->cpu[c].maxpcs, lock->pcs, sizeof lock->pcs);
+    }
+  }
+
   lock->pcs[0] = 0;
   lock->cpu = 0xffffffff;
 
@@ -59,11 +264,94 @@ release(struct spinlock *lock)
   // by the Intel manuals, but does not happen on current 
   // Intel processors.  The xchg being asm volatile also keeps
   // gcc from delaying the above assignments.)
+  barrier();
+#if SPINLOCK == SPIN_TAS
   xchg(&lock->locked, 0);
+#elif SPINLOCK == SPIN_TICKET
+  xchg(&lock->owner, lock->owner + 1);
+#else
+  // If nobody is queued behind us, empty the queue.
+  // Otherwise wait for the next waiter to finish linking
+  // itself in, and hand the lock to it.
+  n = lock->node;
+  if(n->next != 0 || cmpxchg((uint*)&lock->tail, (uint)n, 0) != (uint)n){
+    while(n->next == 0)
+      pause();
+    n->next->wait = 0;
+  }
+  n->busy = 0;
+#endif
 
   popcli();
 }
 
+// Average cycles for an uncontended acquire and release,
+// and for a pushcli and popcli, on this CPU.
+static void
+lockbench(uint *lockcyc, uint *clicyc)
+{
+  static struct spinlock lk;
+  unsigned long long t0;
+  int i;
+
+  initlock(&lk, "lockbench");
+  t0 = rdtsc();
+  for(i = 0; i < 1000; i++){
+    acquire(&lk);
+    release(&lk);
+  }
+  *lockcyc = (uint)(rdtsc() - t0) / 1000;
+  t0 = rdtsc();
+  for(i = 0; i < 1000; i++){
+    pushcli();
+    popcli();
+  }
+  *clicyc = (uint)(rdtsc() - t0) / 1000;
+}
+
+// Print the statistics of every kind of lock that has been
+// acquired: acquisitions, contended acquisitions, kilocycles
+// spent spinning, and the longest hold in kilocycles with the
+// call stack that took the lock for it, after timing the
+// lock primitives themselves.  Called from the console on ^L.
+void
+lockdump(void)
+{
+  struct lockstat *s;
+  uint nacquire, ncontend, *pcs, lockcyc, clicyc;
+  unsigned long long spin, maxhold;
+  int c, i;
+
+  lockbench(&lockcyc, &clicyc);
+  cprintf("cpu%d: acquire+release %d cycles, pushcli+popcli %d cycles\n",
+          cpu(), lockcyc, clicyc);
+  cprintf("lock acquires contended spin-kcyc maxhold-kcyc\n");
+  for(s = lockstats; s < &lockstats[NLOCKCLASS] && s->name; s++){
+    nacquire = ncontend = 0;
+    spin = maxhold = 0;
+    pcs = 0;
+    for(c = 0; c < NCPU; c++){
+      nacquire += s->cpu[c].nacquire;
+      ncontend += s->cpu[c].ncontend;
+      spin += s->cpu[c].spin;
+      if(s->cpu[c].maxhold > maxhold){
+        maxhold = s->cpu[c].maxhold;
+        pcs = s->cpu[c].maxpcs;
+      }
+    }
+    if(nacquire == 0)
+      continue;
+    cprintf("%s %d %d %d %d", s->name, nacquire, ncontend,
+            (uint)(spin >> 10), (uint)(maxhold >> 10));
+    for(i = 0; pcs && i < 10 && pcs[i]; i++)
+      cprintf(" %p", pcs[i]);
+    cprintf("\n");
+  }
+#ifdef LOCKDEP
+  lockdep_dump();
+#endif
+}
+
 // Record the current call stack in pcs[] by following the %ebp chain.
 void
 getcallerpcs(void *v, uint pcs[])
@@ -86,7 +374,7 @@ getcallerpcs(void *v, uint pcs[])
 int
 holding(struct spinlock *lock)
 {
-  return lock->locked && lock->cpu == cpu() + 10;
+  return lock->cpu == mycpu()->id + 10;
 }
 
 
@@ -97,22 +385,27 @@ holding(struct spinlock *lock)
 void
 pushcli(void)
 {
+  struct cpu *c;
   int eflags;
   
   eflags = read_eflags();
   cli();
-  if(cpus[cpu()].ncli++ == 0)
-    cpus[cpu()].intena = eflags & FL_IF;
+  c = mycpu();
+  if(c->ncli++ == 0)
+    c->intena = eflags & FL_IF;
 }
 
 void
 popcli(void)
 {
+  struct cpu *c;
+
   if(read_eflags()&FL_IF)
     panic("popcli - interruptible");
-  if(--cpus[cpu()].ncli < 0)
+  c = mycpu();
+  if(--c->ncli < 0)
     panic("popcli");
-  if(cpus[cpu()].ncli == 0 && cpus[cpu()].intena)
+  if(c->ncli == 0 && c->intena)
     sti();
 }
 
@@ -1,14 +1,47 @@
 #ifndef _SPINLOCK_H_
 #define _SPINLOCK_H_
+
+// Spin lock implementations.  SPINLOCK picks the one that
+// acquire() and release() use for every lock in the kernel.
+#define SPIN_TAS     0   // Test-and-set: simple, unfair
+#define SPIN_TICKET  1   // Ticket: FIFO, waiters spin on one word
+#define SPIN_MCS     2   // MCS queue: FIFO, each waiter spins on its own node
+
+#ifndef SPINLOCK
+#define SPINLOCK SPIN_TICKET
+#endif
+
+// Queue node for an MCS lock.  Each CPU has a small pool of these;
+// a CPU uses one per MCS lock it holds or is waiting for.
+struct mcsnode {
+  struct mcsnode *volatile next;  // Next waiter in the queue
+  volatile uint wait;             // Spin while non-zero
+  uint busy;                      // In use by its CPU
+};
+
+// Contention statistics, shared by all locks with the same name.
+// The locks with one name form a class; lockdep (lockdep.c)
+// keeps one bit per class in a uint, hence at most 32.
+#define NLOCKCLASS 32
+struct lockstat;
+
 // Mutual exclusion lock.
 struct spinlock {
-  uint locked;   // Is the lock held?
-  
+  uint locked;   // Is the lock held? (SPIN_TAS)
+  uint next;     // Next ticket to hand out (SPIN_TICKET)
+  uint owner;    // Ticket being served (SPIN_TICKET)
+  struct mcsnode *tail;  // Last node in the queue (SPIN_MCS)
+  struct mcsnode *node;  // Holder's node (SPIN_MCS)
+
   // For debugging:
   char *name;    // Name of lock.
   int  cpu;      // The number of the cpu holding the lock.
   uint pcs[10];  // The call stack (an array of program counters)
                  // that locked the lock.
+
+  // For statistics:
+  struct lockstat *stat;       // Counters for this lock's name
+  unsigned long long tstart;   // rdtsc() when acquired
 };
 typedef struct spinlock spinlock_t;
 #endif
@@ -0,0 +1,216 @@
+// Swap space.
+//
+// Pages that reclaim (vmscan.c) takes from processes are written
+// to slots in a swap area on disk, and their PTEs hold a swap
+// entry, SWPENTRY(slot), instead of a mapping.  A fault on a swap
+// entry reads the page back with swap_in.
+//
+// A page being written out stays in the swap cache, cache[slot],
+// until the write is done.  A fault meanwhile takes it straight
+// back, and the slot is freed when the write finishes; the page
+// is freed only if nobody took it back.  A slot holds at most
+// one page, mapped once: reclaim only swaps out pages with a
+// single mapping.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "buf.h"
+#include "pmap.h"
+
+#define SECTPERPAGE (PAGE / 512)
+
+// Slot states.
+#define SW_USED  1   // Holds a page, or is about to
+#define SW_IO    2   // A read or write is in progress
+#define SW_DEAD  4   // Freed during I/O; free when it ends
+
+static struct {
+  struct spinlock lock;
+  uchar state[NSWAP];
+  struct Page *cache[NSWAP];  // Page being written out
+  uint rotor;                 // Where to look for a free slot
+  uint nused;
+  uint outs, ins, rescued;    // Pages written, read, taken back
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+}
+
+// Copy a page to or from slot.
+static void
+swap_rw(int slot, char *page, int write)
+{
+  struct buf b;
+  int i;
+
+  memset(&b, 0, sizeof(b));
+  initsleeplock(&b.lock, "swapbuf");
+  acquire_sleep(&b.lock);
+  b.dev = SWAPDEV;
+  for(i = 0; i < SECTPERPAGE; i++){
+    b.sector = SWAPSTART + slot*SECTPERPAGE + i;
+    if(write){
+      memmove(b.data, page + i*512, 512);
+      b.flags = B_DIRTY;
+    } else
+      b.flags = 0;
+    ide_rw(&b);
+    if(!write)
+      memmove(page + i*512, b.data, 512);
+  }
+  release_sleep(&b.lock);
+}
+
+// Reserve a free slot for writing a page out.
+// Returns the slot, or -1 if swap is full.
+int
+swap_alloc(void)
+{
+  int i, slot;
+
+  acquire(&swap.lock);
+  for(i = 0; i < NSWAP; i++){
+    slot = (swap.rotor + i) % NSWAP;
+    if(swap.state[slot] == 0){
+      swap.state[slot] = SW_USED | SW_IO;
+      swap.rotor = slot + 1;
+      swap.nused++;
+      release(&swap.lock);
+      return slot;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Free slot.  Caller holds swap.lock.
+static void
+slotfree(int slot)
+{
+  swap.state[slot] = 0;
+  swap.cache[slot] = 0;
+  swap.nused--;
+}
+
+// Give back a slot from swap_alloc that was not used after all.
+void
+swap_cancel(int slot)
+{
+  acquire(&swap.lock);
+  slotfree(slot);
+  release(&swap.lock);
+}
+
+// Drop the swap entry for slot, whose PTE has been cleared.
+void
+swap_free(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.state[slot] & SW_IO)
+    swap.state[slot] |= SW_DEAD;
+  else
+    slotfree(slot);
+  release(&swap.lock);
+}
+
+// Write p, which reclaim has just unmapped with a swap entry
+// for slot, to its slot, then free it unless a fault took it
+// back meanwhile.  The caller must have put p in the swap cache
+// with swap_cache before installing the entry.
+void
+swap_writepage(int slot, struct Page *p)
+{
+  int freepage;
+
+  swap_rw(slot, (char*)page_addr(p), 1);
+  acquire(&swap.lock);
+  swap.state[slot] &= ~SW_IO;
+  swap.outs++;
+  freepage = swap.cache[slot] == p;
+  swap.cache[slot] = 0;
+  if(!freepage || (swap.state[slot] & SW_DEAD))
+    slotfree(slot);
+  release(&swap.lock);
+  if(freepage)
+    kfree((char*)page_addr(p), PAGE);
+}
+
+// Note that p is on its way out to slot.
+void
+swap_cache(int slot, struct Page *p)
+{
+  acquire(&swap.lock);
+  swap.cache[slot] = p;
+  release(&swap.lock);
+}
+
+// Bring back the page whose swap entry, entry, is the PTE for
+// va in pgdir.  Returns 0 when the fault can be retried, or -1
+// if out of memory.  Sleeps for the disk, so the caller must
+// not hold a spin lock.
+int
+swap_in(pde_t *pgdir, vaddr_t va, pte_t entry)
+{
+  struct Page *p;
+  char *mem;
+  int slot;
+
+  slot = SWPSLOT(entry);
+  acquire(&swap.lock);
+  if(read_pte(pgdir, va) != entry){
+    release(&swap.lock);
+    return 0;
+  }
+  if((p = swap.cache[slot]) != 0){
+    // Still being written: take it back.
+    swap.cache[slot] = 0;
+    swap.rescued++;
+    release(&swap.lock);
+    if(map_swapped(pgdir, va, entry, p) < 0){
+      // Unmapped meanwhile: let the writer free it.
+      acquire(&swap.lock);
+      swap.cache[slot] = p;
+      release(&swap.lock);
+    }
+    return 0;
+  }
+  if(swap.state[slot] & SW_IO){
+    // Someone else is reading it in.
+    release(&swap.lock);
+    return 0;
+  }
+  swap.state[slot] |= SW_IO;
+  release(&swap.lock);
+
+  if((mem = kalloc(PAGE)) == 0){
+    acquire(&swap.lock);
+    swap.state[slot] &= ~SW_IO;
+    if(swap.state[slot] & SW_DEAD)
+      slotfree(slot);
+    release(&swap.lock);
+    return -1;
+  }
+  swap_rw(slot, mem, 0);
+
+  // Map the page before the slot can be reused; if the
+  // entry was unmapped meanwhile, the page is not wanted.
+  if(map_swapped(pgdir, va, entry, page_frame(mem)) < 0)
+    kfree(mem, PAGE);
+  acquire(&swap.lock);
+  swap.ins++;
+  slotfree(slot);
+  release(&swap.lock);
+  return 0;
+}
+
+void
+swapdump(void)
+{
+  cprintf("swap: %d/%d slots used, %d out, %d in, %d taken back\n",
+          swap.nused, NSWAP, swap.outs, swap.ins, swap.rescued);
+}
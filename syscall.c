@@ -81,19 +81,27 @@ extern int sys_close(void);
 extern int sys_dup(void);
 extern int sys_exec(void);
 extern int sys_exit(void);
+extern int sys_faultaround(void);
+extern int sys_faults(void);
 extern int sys_fork(void);
+extern int sys_freemem(void);
 extern int sys_fstat(void);
 extern int sys_getpid(void);
 extern int sys_kill(void);
 extern int sys_link(void);
+extern int sys_madvise(void);
 extern int sys_mkdir(void);
 extern int sys_mknod(void);
 extern int sys_open(void);
 extern int sys_pipe(void);
+extern int sys_procmem(void);
 extern int sys_read(void);
 extern int sys_sbrk(void);
+extern int sys_sbrkflags(void);
+extern int sys_setrlimit(void);
 extern int sys_sleep(void);
 extern int sys_unlink(void);
+extern int sys_uptime(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 
@@ -103,19 +111,27 @@ static int (*syscalls[])(void) = {
 [SYS_dup]     sys_dup,
 [SYS_exec]    sys_exec,
 [SYS_exit]    sys_exit,
+[SYS_faultaround] sys_faultaround,
+[SYS_faults]  sys_faults,
 [SYS_fork]    sys_fork,
+[SYS_freemem] sys_freemem,
 [SYS_fstat]   sys_fstat,
 [SYS_getpid]  sys_getpid,
 [SYS_kill]    sys_kill,
 [SYS_link]    sys_link,
+[SYS_madvise] sys_madvise,
 [SYS_mkdir]   sys_mkdir,
 [SYS_mknod]   sys_mknod,
 [SYS_open]    sys_open,
 [SYS_pipe]    sys_pipe,
+[SYS_procmem] sys_procmem,
 [SYS_read]    sys_read,
 [SYS_sbrk]    sys_sbrk,
+[SYS_sbrkflags] sys_sbrkflags,
+[SYS_setrlimit] sys_setrlimit,
 [SYS_sleep]   sys_sleep,
 [SYS_unlink]  sys_unlink,
+[SYS_uptime]  sys_uptime,
 [SYS_wait]    sys_wait,
 [SYS_write]   sys_write,
 };
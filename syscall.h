@@ -19,3 +19,22 @@
 #define SYS_getpid 18
 #define SYS_sbrk   19
 #define SYS_sleep  20
+#define SYS_uptime 21
+#define SYS_freemem 22
+#define SYS_sbrkflags 23
+#define SYS_faultaround 24
+#define SYS_faults 25
+#define SYS_madvise 26
+#define SYS_setrlimit 27
+#define SYS_procmem 28
+
+// Flags for sbrkflags.
+#define SBRK_POPULATE 0x1  // map the new memory now, not on first touch
+
+// Advice for madvise.
+#define MADV_DONTNEED 1  // free the pages; they read as zero next time
+#define MADV_WILLNEED 2  // map the pages now
+
+// Resources for setrlimit.
+#define RLIMIT_RSS 0  // pages a process may have resident
+#define RLIM_INFINITY 0x7fffffff  // no limit
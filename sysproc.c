@@ -3,6 +3,10 @@
 #include "param.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "ktimer.h"
+#include "syscall.h"
+#include "procmem.h"
 
 int
 sys_fork(void)
@@ -13,7 +17,7 @@ sys_fork(void)
   if((np = copyproc(cp)) == 0)
     return -1;
   pid = np->pid;
-  np->state = RUNNABLE;
+  setrunnable(np);
   return pid;
 }
 
@@ -54,27 +58,146 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  if((addr = growproc(n)) < 0)
+  if((addr = growproc(n, 0)) < 0)
     return -1;
   return addr;
 }
 
+// sbrk, with flags: SBRK_POPULATE maps the new memory
+// at once, instead of a fault at a time.
+int
+sys_sbrkflags(void)
+{
+  int addr;
+  int n, flags;
+
+  if(argint(0, &n) < 0 || argint(1, &flags) < 0)
+    return -1;
+  if((addr = growproc(n, flags)) < 0)
+    return -1;
+  return addr;
+}
+
+// Set the number of pages a page fault maps, a power of
+// two from 1 to 64.  Returns the old number.
+int
+sys_faultaround(void)
+{
+  int n, old;
+
+  if(argint(0, &n) < 0 || n < 1 || n > 64 || (n & (n - 1)))
+    return -1;
+  old = cp->faultaround;
+  cp->faultaround = n;
+  return old;
+}
+
+// Return the number of page faults this process has taken.
+int
+sys_faults(void)
+{
+  return cp->nfault;
+}
+
+// Set a limit on the use of a resource; only RLIMIT_RSS,
+// in pages, for now.  Returns the old limit.
+int
+sys_setrlimit(void)
+{
+  int resource, lim, old;
+
+  if(argint(0, &resource) < 0 || argint(1, &lim) < 0)
+    return -1;
+  if(resource != RLIMIT_RSS || lim < 1)
+    return -1;
+  old = cp->rsslimit;
+  cp->rsslimit = lim;
+  return old;
+}
+
+// Fill buf with the memory use of up to n processes.
+// Returns the number filled in.
+int
+sys_procmem(void)
+{
+  struct procmem *pm;
+  char *buf;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  if(n > PAGE / sizeof(*pm))
+    n = PAGE / sizeof(*pm);
+  if(argptr(0, &buf, n * sizeof(*pm)) < 0)
+    return -1;
+  // Gather into a kernel page first: copying to buf
+  // may fault, which must not happen in procmem.
+  if((pm = (struct procmem*)kalloc(PAGE)) == 0)
+    return -1;
+  n = procmem(pm, n);
+  memmove(buf, pm, n * sizeof(*pm));
+  kfree((char*)pm, PAGE);
+  return n;
+}
+
+int
+sys_madvise(void)
+{
+  int addr, len, advice;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0)
+    return -1;
+  if(len < 0)
+    return -1;
+  return madvise(addr, len, advice);
+}
+
+// Timer callback for sys_sleep: the sleep is over.
+static void
+sleep_timeout(void *done)
+{
+  acquire(&tickslock);
+  *(int*)done = 1;
+  wakeup(done);
+  release(&tickslock);
+}
+
 int
 sys_sleep(void)
 {
-  int n, ticks0;
+  int n, done;
+  struct ktimer t;
   
   if(argint(0, &n) < 0)
     return -1;
+  if(n <= 0)
+    return 0;
+
+  // Sleep until the timer fires, rather than waking
+  // up on every tick to check the time.
+  done = 0;
+  ktimer_setup(&t, sleep_timeout, &done);
   acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(cp->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
+  ktimer_add(&t, ticks + n);
+  while(!done && !cp->killed)
+    sleep(&done, &tickslock);
   release(&tickslock);
-  return 0;
+  ktimer_del_sync(&t);
+  return done ? 0 : -1;
+}
+
+// Return how many clock tick interrupts have occurred
+// since boot.
+int
+sys_uptime(void)
+{
+  return ticks;
+}
+
+// Return the number of free physical pages, counting
+// those in the kernel stack caches.
+int
+sys_freemem(void)
+{
+  return kfreecount() + kstack_cached();
 }
@@ -0,0 +1,159 @@
+// TLB invalidation.
+//
+// Each CPU caches translations in its TLB and does not notice
+// when a PTE changes.  Whoever removes or downgrades a present
+// mapping must invalidate it on every CPU that may have cached
+// it before the page is reused: with invlpg on this CPU, and
+// with an IPI (a "shootdown") to each other CPU whose cr3 is
+// the same page directory.  CPUs running other address spaces
+// need nothing, since loading cr3 flushes all but global
+// entries.  Adding a mapping where none was present needs no
+// invalidation at all: the TLB never caches a not-present PTE.
+//
+// A CPU that goes idle keeps the last page directory loaded
+// (see scheduler), so before a page directory is freed,
+// tlb_release makes every CPU still on it switch to boot_pgdir.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "traps.h"
+#include "pmap.h"
+
+// Past this many pages, one cr3 reload is cheaper than invlpgs.
+#define TLB_FLUSHALL 32
+
+// The shootdown in progress.  One CPU at a time sends one;
+// the fields do not change until every target has cleared
+// its pending flag.
+static struct {
+  struct spinlock lock;
+  paddr_t cr3;              // Address space, or 0 for all
+  vaddr_t start, end;       // Range to invalidate
+  int leave;                // Leave cr3 instead (tlb_release)
+  volatile uint pending[NCPU];
+} shootdown;
+
+void
+tlb_init(void)
+{
+  initlock(&shootdown.lock, "shootdown");
+}
+
+// Invalidate [start, end) on this CPU.
+static void
+flushlocal(vaddr_t start, vaddr_t end)
+{
+  vaddr_t va;
+
+  if(end - start > TLB_FLUSHALL*PAGE){
+    lcr3(rcr3());
+    return;
+  }
+  for(va = start; va < end; va += PAGE)
+    invlpg((void*)va);
+}
+
+// Carry out this CPU's part of the current shootdown, if any.
+// Called from the IPI, and by CPUs that wait to send their own.
+void
+tlb_ipi(void)
+{
+  struct cpu *c;
+
+  c = mycpu();
+  if(!shootdown.pending[c->id])
+    return;
+  if(shootdown.leave){
+    if(shootdown.cr3 == c->cr3){
+      c->cr3 = (paddr_t)boot_pgdir;
+      lcr3(c->cr3);
+    }
+  } else if(shootdown.cr3 == 0 || shootdown.cr3 == c->cr3)
+    flushlocal(shootdown.start, shootdown.end);
+  barrier();
+  shootdown.pending[c->id] = 0;
+}
+
+// Send a shootdown for pgdir to every other CPU that may have
+// it loaded, and wait until all have carried it out.
+static void
+shoot(pde_t *pgdir, vaddr_t start, vaddr_t end, int leave)
+{
+  struct cpu *c;
+  int i, n;
+
+  pushcli();
+  c = mycpu();
+
+  // Only CPUs that may have pgdir loaded need an IPI.  A CPU
+  // that switches to pgdir after this check loads cr3 after
+  // the PTE change, and so cannot cache the old entry.  That
+  // takes both sides' fences: here, between the caller's PTE
+  // store and the loads of cpus[].cr3, and in switchsegs,
+  // between the store of c->cr3 and the load of cr3.
+  mfence();
+  n = 0;
+  for(i = 0; i < ncpu; i++)
+    if(&cpus[i] != c && cpus[i].booted &&
+       (pgdir == 0 || cpus[i].cr3 == (paddr_t)pgdir))
+      n++;
+  if(n == 0){
+    popcli();
+    return;
+  }
+
+  // Another CPU may be waiting for this one, so keep
+  // answering its shootdown while waiting to send.
+  while(!tryacquire(&shootdown.lock))
+    tlb_ipi();
+  shootdown.cr3 = (paddr_t)pgdir;
+  shootdown.start = start;
+  shootdown.end = end;
+  shootdown.leave = leave;
+  for(i = 0; i < ncpu; i++){
+    if(&cpus[i] == c || !cpus[i].booted ||
+       (pgdir != 0 && cpus[i].cr3 != (paddr_t)pgdir))
+      continue;
+    shootdown.pending[i] = 1;
+    lapic_ipi(cpus[i].apicid, IRQ_OFFSET + IRQ_TLB);
+  }
+  for(i = 0; i < ncpu; i++)
+    while(shootdown.pending[i])
+      pause();
+  release(&shootdown.lock);
+  popcli();
+}
+
+// Invalidate the translations of [start, end) in the address
+// space with page directory pgdir, on every CPU using it, and
+// wait until they are gone.  pgdir 0 means kernel mappings,
+// which every CPU shares.  The caller must not hold a spin
+// lock, since the CPUs it waits for may be spinning on it with
+// interrupts off.
+void
+tlb_invalidate(pde_t *pgdir, vaddr_t start, vaddr_t end)
+{
+  struct cpu *c;
+
+  pushcli();
+  c = mycpu();
+  if(pgdir == 0 || c->cr3 == (paddr_t)pgdir)
+    flushlocal(start, end);
+  shoot(pgdir, start, end, 0);
+  popcli();
+}
+
+// Make every CPU that still has pgdir loaded, idle since the
+// process that used it left, switch to boot_pgdir, so that
+// pgdir can be freed.  No process may be running on pgdir.
+// The caller must not hold a spin lock.
+void
+tlb_release(pde_t *pgdir)
+{
+  shoot(pgdir, 0, 0, 1);
+}
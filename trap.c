@@ -55,9 +55,14 @@ trap(struct trapframe *tf)
     if(cpu() == 0){
       acquire(&tickslock);
       ticks++;
-      wakeup(&ticks);
       release(&tickslock);
     }
+    // A CPU interrupted in user mode cannot be
+    // inside an RCU read section.
+    if((tf->cs&3) == DPL_USER)
+      rcu_qs();
+    ktimer_run();
+    rcu_poll();
     lapic_eoi();
     break;
   case IRQ_OFFSET + IRQ_IDE:
@@ -68,6 +73,10 @@ trap(struct trapframe *tf)
     kbd_intr();
     lapic_eoi();
     break;
+  case IRQ_OFFSET + IRQ_TLB:
+    tlb_ipi();
+    lapic_eoi();
+    break;
   case IRQ_OFFSET + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
             cpu(), tf->cs, tf->eip);
@@ -75,13 +84,30 @@ trap(struct trapframe *tf)
     break;
   case T_PGFLT:
     cr2 = rcr2();
-    if (cp == 0 || (tf->cs&3) == 0) {
+    // The kernel may touch user memory on a process's
+    // behalf; such a fault is handled as the process's own.
+    if (cp == 0 || ((tf->cs&3) == 0 && (cr2 < KERNTOP || cr2 >= KERNTOP + cp->sz))) {
+      if (cr2 >= KSTACKGUARD && cr2 < KSTACKGUARD + PAGE)
+        panic("kernel stack overflow");
       cprintf("page fault in kernel from cpu %x eip %x cr2 %x",cpu(), tf->eip, cr2);
       panic("trap due to kernel page fault");
     }
-    if (pgfault_handler(cr2) < 0) {
-      cprintf("can not handler user page fault from cpu %x eip %x cr2 %x",cpu(), tf->eip, cr2);
-      panic("trap due to user page fault");
+    if (pgfault_handler(cr2, (tf->cs&3) == DPL_USER) < 0) {
+      if ((tf->cs&3) == DPL_USER) {
+        // Out of memory, or over its RSS limit.
+        cprintf("pid %d %s: page fault on cpu %d eip %x cr2 %x, %d pages resident -- kill proc\n",
+                cp->pid, cp->name, cpu(), tf->eip, cr2, pgdir_rss(cp->vm.pgdir));
+        cp->killed = 1;
+        break;
+      }
+      // A syscall's access to user memory that cannot be
+      // backed: let it finish on the scratch page, and kill
+      // the process when the syscall returns.
+      cprintf("pid %d %s: kernel page fault on cpu %d eip %x cr2 %x -- kill proc\n",
+              cp->pid, cp->name, cpu(), tf->eip, cr2);
+      cp->killed = 1;
+      if (map_scratch(cp->vm.pgdir, PTE_ADDR(cr2)) < 0)
+        panic("trap due to user page fault");
     }
     break;
   default:
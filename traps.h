@@ -33,4 +33,5 @@
 #define IRQ_KBD          1
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_TLB         20      // TLB shootdown IPI
 #define IRQ_SPURIOUS    31
@@ -9,6 +9,8 @@ typedef uint pte_t;
 typedef uint vaddr_t;
 typedef uint paddr_t;
 
+#define NULL ((void *) 0)
+
 // Rounding operations (efficient when n is a power of 2)
 // Round down to the nearest multiple of n
 #define ROUNDDOWN(a,n)			\
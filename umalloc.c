@@ -2,10 +2,16 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "syscall.h"
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
 
+// free() gives the whole pages of a freed block back to the
+// kernel with madvise when there are at least this many bytes
+// of them; they come back zeroed when next touched.
+#define RELEASE_MIN (16*PAGE)
+
 typedef long Align;
 
 union header {
@@ -21,12 +27,13 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+// Put block bp on the free list, merging it with its
+// neighbours.  Returns the block it ends up in.
+static Header*
+insert(Header *bp)
 {
-  Header *bp, *p;
+  Header *p;
 
-  bp = (Header*) ap - 1;
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -38,9 +45,34 @@ free(void *ap)
   if(p + p->s.size == bp){
     p->s.size += bp->s.size;
     p->s.ptr = bp->s.ptr;
+    bp = p;
   } else
     p->s.ptr = bp;
   freep = p;
+  return bp;
+}
+
+void
+free(void *ap)
+{
+  Header *bp;
+  uint lo, hi, start, end;
+
+  bp = (Header*) ap - 1;
+  lo = ROUNDDOWN((uint)bp, PAGE);
+  hi = ROUNDUP((uint)(bp + bp->s.size), PAGE);
+  bp = insert(bp);
+
+  // Only the pages free now that were not free before: the
+  // freed block's, and those it shares with its neighbours.
+  start = ROUNDUP((uint)(bp + 1), PAGE);
+  end = ROUNDDOWN((uint)(bp + bp->s.size), PAGE);
+  if(start < lo)
+    start = lo;
+  if(end > hi)
+    end = hi;
+  if(start < end && end - start >= RELEASE_MIN)
+    madvise((void*)start, end - start, MADV_DONTNEED);
 }
 
 static Header*
@@ -56,7 +88,7 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  insert(hp);
   return freep;
 }
 
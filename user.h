@@ -1,4 +1,5 @@
 struct stat;
+struct procmem;
 
 // system calls
 int fork(void);
@@ -21,6 +22,14 @@ int dup(int);
 int getpid();
 char* sbrk(int);
 int sleep(int);
+int uptime(void);
+int freemem(void);
+char* sbrkflags(int, int);
+int faultaround(int);
+int faults(void);
+int madvise(void*, int, int);
+int setrlimit(int, int);
+int procmem(struct procmem*, int);
 
 // ulib.c
 int stat(char*, struct stat*);
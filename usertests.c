@@ -3,6 +3,8 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "syscall.h"
+#include "procmem.h"
 
 char buf[2048];
 char name[3];
@@ -1230,6 +1232,460 @@ forktest(void)
   printf(1, "fork test OK\n");
 }
 
+// Run forktest over and over: every child's page tables,
+// page directory and kernel stack must go back to the
+// allocator when it is reaped, so the free page count must
+// come back to where it started.
+void
+leaktest(void)
+{
+  char *args[] = { "forktest", 0 };
+  int i, pid, before, after;
+
+  printf(1, "leak test\n");
+  before = 0;
+  for(i = 0; i < 6; i++){
+    // The first run may grow the process table,
+    // which is never freed; count from the second.
+    if(i == 1)
+      before = freemem();
+    pid = fork();
+    if(pid < 0){
+      printf(1, "leaktest: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      exec("forktest", args);
+      printf(1, "leaktest: exec forktest failed\n");
+      exit();
+    }
+    wait();
+  }
+  after = freemem();
+  if(after != before){
+    printf(1, "leaktest: %d free pages before, %d after\n", before, after);
+    exit();
+  }
+  printf(1, "leak test ok\n");
+}
+
+// Grow the heap by 4MB and touch every page, a page fault at
+// a time, with fault-around, and populated up front by
+// sbrkflags.  Each run is in a child, so that its memory goes
+// back when it exits.  Every page must read as zero.
+void
+faultbench(void)
+{
+  static struct {
+    char *name;
+    int window, flags;
+  } runs[] = {
+    { "one page per fault", 1, 0 },
+    { "fault-around", 16, 0 },
+    { "populated by sbrk", 16, SBRK_POPULATE },
+  };
+  int i, n, f0, t0, pid;
+  char *p;
+
+  printf(1, "fault benchmark\n");
+  for(i = 0; i < sizeof(runs)/sizeof(runs[0]); i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "faultbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      faultaround(runs[i].window);
+      f0 = faults();
+      t0 = uptime();
+      p = sbrkflags(4*1024*1024, runs[i].flags);
+      if(p == (char*)-1){
+        printf(1, "faultbench: sbrk failed\n");
+        exit();
+      }
+      for(n = 0; n < 4*1024*1024; n += 4096){
+        if(p[n] != 0){
+          printf(1, "faultbench: page not zeroed\n");
+          exit();
+        }
+        p[n] = 1;
+      }
+      printf(1, "%s: %d faults, %d ticks\n", runs[i].name,
+             faults() - f0, uptime() - t0);
+      exit();
+    }
+    wait();
+  }
+  printf(1, "fault benchmark ok\n");
+}
+
+// Memory given back by shrinking sbrk, by madvise, and by
+// free() of a large block must show up as free pages, and
+// read as zero when touched again.  Runs in a child, so that
+// nothing else it does changes the count.
+void
+releasetest(void)
+{
+  int pid, n, before;
+  char *p, *q;
+
+  printf(1, "release test\n");
+  pid = fork();
+  if(pid < 0){
+    printf(1, "releasetest: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    p = sbrkflags(256*4096, SBRK_POPULATE);
+    if(p == (char*)-1){
+      printf(1, "releasetest: sbrk failed\n");
+      exit();
+    }
+    memset(p, 1, 256*4096);
+
+    before = freemem();
+    if(madvise(p + 64*4096, 128*4096, MADV_DONTNEED) < 0 ||
+       freemem() - before < 128){
+      printf(1, "releasetest: madvise freed %d pages\n", freemem() - before);
+      exit();
+    }
+    for(n = 0; n < 256*4096; n += 4096){
+      if(p[n] != (n >= 64*4096 && n < 192*4096 ? 0 : 1)){
+        printf(1, "releasetest: wrong byte after madvise\n");
+        exit();
+      }
+    }
+
+    before = freemem();
+    if(sbrk(-256*4096) != p + 256*4096 || freemem() - before < 256){
+      printf(1, "releasetest: sbrk shrink freed %d pages\n", freemem() - before);
+      exit();
+    }
+    if(sbrk(256*4096) != p || p[0] != 0 || p[255*4096] != 0){
+      printf(1, "releasetest: memory not zeroed after shrink\n");
+      exit();
+    }
+
+    q = malloc(1024*1024);
+    memset(q, 1, 1024*1024);
+    before = freemem();
+    free(q);
+    if(freemem() - before < 200){
+      printf(1, "releasetest: free gave back %d pages\n", freemem() - before);
+      exit();
+    }
+    printf(1, "release test ok\n");
+    exit();
+  }
+  wait();
+}
+
+// This process's resident set, from procmem.
+int
+myrss(void)
+{
+  static struct procmem pm[64];
+  int i, n;
+
+  n = procmem(pm, 64);
+  for(i = 0; i < n; i++)
+    if(pm[i].pid == getpid())
+      return pm[i].rss;
+  return -1;
+}
+
+// Mapping pages must show in the resident set, and a process
+// touching more pages than its RSS limit must be killed.
+void
+rsstest(void)
+{
+  int pid, fds[2], rss;
+  char *p, c;
+
+  printf(1, "rss test\n");
+  rss = myrss();
+  p = sbrkflags(32*4096, SBRK_POPULATE);
+  if(p == (char*)-1 || myrss() - rss < 32){
+    printf(1, "rsstest: rss %d after mapping 32 pages to %d\n", myrss(), rss);
+    exit();
+  }
+  sbrk(-32*4096);
+  if(myrss() - rss > 1){
+    printf(1, "rsstest: rss %d after unmapping them\n", myrss());
+    exit();
+  }
+
+  if(pipe(fds) < 0){
+    printf(1, "rsstest: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "rsstest: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    faultaround(1);
+    setrlimit(RLIMIT_RSS, myrss() + 16);
+    p = sbrk(64*4096);
+    for(rss = 0; rss < 64*4096; rss += 4096)
+      p[rss] = 1;
+    write(fds[1], "x", 1);
+    exit();
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 0){
+    printf(1, "rsstest: child went over its limit\n");
+    exit();
+  }
+  close(fds[0]);
+  wait();
+  printf(1, "rss test ok\n");
+}
+
+// A child touches more pages than are free, each with its own
+// pattern, so that some go out to swap and come back, and then
+// checks every byte.  Once it has exited, partly swapped out,
+// all the memory must be free again.
+void
+swaptest(void)
+{
+  int pid, fds[2], i, n, before, after;
+  char *p, c;
+
+  printf(1, "swap test\n");
+  if(pipe(fds) < 0){
+    printf(1, "swaptest: pipe failed\n");
+    exit();
+  }
+  before = freemem();
+  pid = fork();
+  if(pid < 0){
+    printf(1, "swaptest: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(fds[0]);
+    n = (freemem() + 256) * 4096;
+    p = sbrk(n);
+    if(p == (char*)-1){
+      printf(1, "swaptest: sbrk failed\n");
+      exit();
+    }
+    for(i = 0; i < n; i++)
+      p[i] = i / 4096 + i;
+    for(i = 0; i < n; i++){
+      if(p[i] != (char)(i / 4096 + i)){
+        printf(1, "swaptest: wrong byte in page %d\n", i / 4096);
+        exit();
+      }
+    }
+    write(fds[1], "x", 1);
+    exit();
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 1){
+    printf(1, "swaptest: child did not finish\n");
+    exit();
+  }
+  close(fds[0]);
+  wait();
+  // Pages of other processes may still be out in swap, so
+  // there can be more free than before, but not less.
+  after = freemem();
+  if(after < before){
+    printf(1, "swaptest: %d free pages before, %d after\n", before, after);
+    exit();
+  }
+  printf(1, "swap test ok\n");
+}
+
+// A child fills the free memory and gives back every other
+// page, leaving it in single pages.  Then a storm of forks,
+// each needing its memory in one piece, which only compaction
+// can make.  The child's pages that compaction moved must
+// have kept their bytes.
+void
+compacttest(void)
+{
+  int pid, ready[2], done[2], i, n, failed;
+  char *p, c;
+
+  printf(1, "compaction test\n");
+  if(pipe(ready) < 0 || pipe(done) < 0){
+    printf(1, "compacttest: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "compacttest: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(ready[0]);
+    close(done[1]);
+    n = freemem() * 4096;
+    p = sbrk(n);
+    if(p == (char*)-1){
+      printf(1, "compacttest: sbrk failed\n");
+      exit();
+    }
+    for(i = 0; i < n; i++)
+      p[i] = i / 4096 + i;
+    for(i = 4096; i < n; i += 2*4096)
+      madvise(p + i, 4096, MADV_DONTNEED);
+    write(ready[1], "x", 1);
+    read(done[0], &c, 1);
+    for(i = 0; i < n; i++){
+      if((i / 4096) % 2 == 0 && p[i] != (char)(i / 4096 + i)){
+        printf(1, "compacttest: wrong byte in page %d\n", i / 4096);
+        exit();
+      }
+    }
+    write(ready[1], "x", 1);
+    exit();
+  }
+  close(ready[1]);
+  close(done[0]);
+  if(read(ready[0], &c, 1) != 1){
+    printf(1, "compacttest: child did not fill memory\n");
+    exit();
+  }
+  failed = 0;
+  for(i = 0; i < 16; i++){
+    pid = fork();
+    if(pid < 0){
+      failed++;
+      continue;
+    }
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  write(done[1], "x", 1);
+  close(done[1]);
+  if(read(ready[0], &c, 1) != 1){
+    printf(1, "compacttest: moved pages changed\n");
+    exit();
+  }
+  close(ready[0]);
+  wait();
+  if(failed){
+    printf(1, "compacttest: %d of 16 forks failed\n", failed);
+    exit();
+  }
+  printf(1, "compaction test ok\n");
+}
+
+// Several processes fork and ping-pong through pipes at
+// the same time: the fork/exit/wait and sleep/wakeup paths
+// used to serialize on one global process table lock.
+void
+contention(void)
+{
+  int i, j, pid, t0, p1[2], p2[2];
+  char c;
+
+  printf(1, "contention test\n");
+  t0 = uptime();
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "contention: fork failed\n");
+      exit();
+    }
+    if(pid > 0)
+      continue;
+
+    for(j = 0; j < 50; j++){
+      pid = fork();
+      if(pid == 0)
+        exit();
+      if(pid < 0 || wait() != pid){
+        printf(1, "contention: fork/wait failed\n");
+        exit();
+      }
+    }
+
+    if(pipe(p1) != 0 || pipe(p2) != 0){
+      printf(1, "contention: pipe failed\n");
+      exit();
+    }
+    pid = fork();
+    if(pid == 0){
+      for(j = 0; j < 200; j++){
+        if(read(p1[0], &c, 1) != 1)
+          break;
+        write(p2[1], &c, 1);
+      }
+      exit();
+    }
+    for(j = 0; j < 200; j++){
+      write(p1[1], "x", 1);
+      if(read(p2[0], &c, 1) != 1){
+        printf(1, "contention: ping-pong failed\n");
+        exit();
+      }
+    }
+    wait();
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    if(wait() < 0){
+      printf(1, "contention: wait failed\n");
+      exit();
+    }
+  }
+  printf(1, "contention test ok: %d ticks\n", uptime() - t0);
+}
+
+// Context switch microbenchmark: two processes bounce a
+// byte back and forth through pipes, so every round trip is
+// two switches, which sched() makes directly from one process
+// to the other.  ^P on the console shows the kernel's switch
+// counts and cycles per switch.
+void
+switchbench(void)
+{
+  int i, pid, t0, p1[2], p2[2];
+  char c;
+
+  printf(1, "switch benchmark\n");
+  if(pipe(p1) != 0 || pipe(p2) != 0){
+    printf(1, "switchbench: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "switchbench: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(p1[1]);
+    close(p2[0]);
+    for(;;){
+      if(read(p1[0], &c, 1) != 1)
+        exit();
+      write(p2[1], &c, 1);
+    }
+  }
+  close(p1[0]);
+  close(p2[1]);
+  t0 = uptime();
+  for(i = 0; i < 2000; i++){
+    write(p1[1], "x", 1);
+    if(read(p2[0], &c, 1) != 1){
+      printf(1, "switchbench: read failed\n");
+      exit();
+    }
+  }
+  printf(1, "switch benchmark ok: 2000 round trips in %d ticks\n", uptime() - t0);
+  close(p1[1]);
+  close(p2[0]);
+  wait();
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -1264,6 +1720,14 @@ main(int argc, char *argv[])
   dirfile();
   iref();
   forktest();
+  leaktest();
+  faultbench();
+  releasetest();
+  rsstest();
+  swaptest();
+  compacttest();
+  contention();
+  switchbench();
   bigdir(); // slow
 
   exectest();
@@ -0,0 +1,216 @@
+// Kernel virtual memory areas.
+//
+// kalloc hands out physically contiguous blocks, so a large
+// buffer needs a free buddy block of its size, which
+// fragmentation can rule out with plenty of pages free.
+// vmalloc instead takes the pages one at a time and maps them
+// side by side in the vmalloc region, [VMALLOC_START,
+// VMALLOC_END), just below the virtual page tables.
+//
+// The region's page tables are made at boot and entered in
+// boot_pgdir, whose entries below KERNTOP every page directory
+// copies.  So a mapping made here later shows in every address
+// space, and one removed must be invalidated on every CPU.
+//
+// Areas in use are kept on a list sorted by address, each with
+// an unmapped guard page after it, so that running off the end
+// of one faults instead of scribbling over the next.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "pmap.h"
+#include "memlayout.h"
+
+#define NVMAREA 64   // Areas in use at once
+#define NVFREE  32   // Pages unmapped per TLB shootdown
+
+struct vmarea {
+  vaddr_t addr;
+  uint size;             // Bytes, not counting the guard page
+  struct vmarea *next;
+};
+
+static struct {
+  struct spinlock lock;
+  struct vmarea area[NVMAREA];
+  struct vmarea *list;   // In use, by address
+  struct vmarea *free;   // Unused entries
+  uint pages;            // Pages mapped
+  uint fails;            // vmallocs that failed
+} vm;
+
+// The PTE for va, in the region.
+static pte_t*
+vmpte(vaddr_t va)
+{
+  return (pte_t*)PTE_ADDR(boot_pgdir[PDX(va)]) + PTX(va);
+}
+
+// Make the region's page tables.  Must run before the first
+// page directory is copied from boot_pgdir.
+void
+vmalloc_init(void)
+{
+  vaddr_t va;
+  char *pt;
+  int i;
+
+  initlock(&vm.lock, "vmalloc");
+  for(i = 0; i < NVMAREA; i++){
+    vm.area[i].next = vm.free;
+    vm.free = &vm.area[i];
+  }
+  for(va = VMALLOC_START; va < VMALLOC_END; va += LPAGE){
+    // Physical memory is mapped at its own address.
+    if(boot_pgdir[PDX(va)] & PTE_P)
+      panic("vmalloc_init: region overlaps memory");
+    if((pt = alloc_page()) == 0)
+      panic("vmalloc_init: out of memory");
+    memset(pt, 0, PAGE);
+    boot_pgdir[PDX(va)] = (uint)pt | PTE_P | PTE_W;
+  }
+}
+
+// Find room for size bytes and a guard page, first fit.
+// Returns the area, or 0 if there is none.
+// Caller holds vm.lock.
+static struct vmarea*
+areaalloc(uint size)
+{
+  struct vmarea *a, **pp;
+  vaddr_t addr;
+
+  if(vm.free == 0)
+    return 0;
+  addr = VMALLOC_START;
+  for(pp = &vm.list; *pp; pp = &(*pp)->next){
+    if((*pp)->addr - addr >= size + PAGE)
+      break;
+    addr = (*pp)->addr + (*pp)->size + PAGE;
+  }
+  if(*pp == 0 && VMALLOC_END - addr < size + PAGE)
+    return 0;
+  a = vm.free;
+  vm.free = a->next;
+  a->addr = addr;
+  a->size = size;
+  a->next = *pp;
+  *pp = a;
+  return a;
+}
+
+// Take a off the list.  Caller holds vm.lock.
+static void
+areafree(struct vmarea *a)
+{
+  struct vmarea **pp;
+
+  for(pp = &vm.list; *pp != a; pp = &(*pp)->next)
+    ;
+  *pp = a->next;
+  a->next = vm.free;
+  vm.free = a;
+}
+
+// Unmap the size bytes at addr and free their pages.
+static void
+vunmap(vaddr_t addr, uint size)
+{
+  char *freed[NVFREE];
+  vaddr_t start, va;
+  pte_t *pte;
+  int n;
+
+  for(va = addr; va < addr + size; ){
+    start = va;
+    for(n = 0; n < NVFREE && va < addr + size; va += PAGE){
+      pte = vmpte(va);
+      freed[n++] = (char*)PTE_ADDR(*pte);
+      *pte = 0;
+    }
+    // Every CPU may have the mapping cached, whatever
+    // address space it is running in.
+    tlb_invalidate(0, start, va);
+    kfree_list(freed, n);
+  }
+}
+
+// Allocate n bytes of zeroed, virtually contiguous kernel
+// memory, a page at a time.  Returns 0 if out of memory, or of
+// room in the region.  The caller must not hold a spin lock.
+void*
+vmalloc(uint n)
+{
+  struct vmarea *a;
+  char *mem;
+  uint size, i;
+
+  if(n == 0)
+    return 0;
+  size = ROUNDUP(n, PAGE);
+  acquire(&vm.lock);
+  if((a = areaalloc(size)) == 0){
+    vm.fails++;
+    release(&vm.lock);
+    return 0;
+  }
+  release(&vm.lock);
+
+  // The range was flushed from every TLB when it was last
+  // freed, so the new PTEs need no invalidation.
+  for(i = 0; i < size; i += PAGE){
+    if((mem = kzalloc(PAGE)) == 0){
+      vunmap(a->addr, i);
+      acquire(&vm.lock);
+      areafree(a);
+      vm.fails++;
+      release(&vm.lock);
+      return 0;
+    }
+    *vmpte(a->addr + i) = (uint)mem | PTE_P | PTE_W;
+  }
+  acquire(&vm.lock);
+  vm.pages += size / PAGE;
+  release(&vm.lock);
+  return (void*)a->addr;
+}
+
+// Free memory from vmalloc.  The caller must not hold a
+// spin lock.
+void
+vfree(void *v)
+{
+  struct vmarea *a;
+
+  acquire(&vm.lock);
+  for(a = vm.list; a && a->addr != (vaddr_t)v; a = a->next)
+    ;
+  release(&vm.lock);
+  if(a == 0)
+    panic("vfree");
+  // The area stays on the list, so that nobody reuses the
+  // range before it is gone from every TLB.
+  vunmap(a->addr, a->size);
+  acquire(&vm.lock);
+  vm.pages -= a->size / PAGE;
+  areafree(a);
+  release(&vm.lock);
+}
+
+void
+vmallocdump(void)
+{
+  struct vmarea *a;
+  int n;
+
+  acquire(&vm.lock);
+  n = 0;
+  for(a = vm.list; a; a = a->next)
+    n++;
+  cprintf("vmalloc: %d areas, %d pages mapped, %d failures\n",
+          n, vm.pages, vm.fails);
+  release(&vm.lock);
+}
@@ -0,0 +1,283 @@
+// Page reclaim.
+//
+// Every page mapped into a user address space is on one of two
+// LRU lists.  New pages start on the active list.  Reclaim ages
+// the active list from its old end, moving the pages whose PTEs
+// were not accessed since the last look to the inactive list,
+// and takes pages off the old end of the inactive list: those
+// accessed meanwhile go back to the active list, the rest are
+// swapped out (swap.c).  A page thus has to go unused through
+// both lists before it is written out.
+//
+// The kswapd kernel thread reclaims in the background whenever
+// free memory falls below a low watermark, until it is back
+// above a high one.  A process whose allocation fails reclaims
+// for itself with reclaim().
+//
+// Lock order: lru.lock, then rmap_lock.  While lru.lock is held
+// a page on a list cannot be freed, since freeing takes it off
+// first; once unmap_begin has marked its PTEs, nobody else can
+// unmap it, so it may be written out after lru.lock is dropped.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "pmap.h"
+#include "buddy.h"
+
+#define SWAP_CLUSTER 32   // Pages to reclaim at a time
+
+struct lrulist {
+  page_list_head_t head;  // Newest first
+  struct Page *tail;      // Oldest
+  uint n;
+};
+
+static struct {
+  struct spinlock lock;
+  struct lrulist active;
+  struct lrulist inactive;
+} lru;
+
+static struct {
+  struct spinlock lock;
+  int sleeping;
+  uint low, high;            // Watermarks, in free pages
+  uint wakeups;
+  uint scanned, deactivated, reclaimed;
+} kswap;
+
+// The page before p on l, or 0 if p is the first.
+static struct Page*
+prevpage(struct lrulist *l, struct Page *p)
+{
+  if(p->lru.le_prev == &LIST_FIRST(&l->head))
+    return 0;
+  return (struct Page*)((char*)p->lru.le_prev - (uint)&((struct Page*)0)->lru.le_next);
+}
+
+static void
+lrulink(struct lrulist *l, struct Page *p)
+{
+  LIST_INSERT_HEAD(&l->head, p, lru);
+  if(l->tail == 0)
+    l->tail = p;
+  l->n++;
+}
+
+static void
+lruunlink(struct lrulist *l, struct Page *p)
+{
+  if(l->tail == p)
+    l->tail = prevpage(l, p);
+  LIST_REMOVE(p, lru);
+  l->n--;
+}
+
+static struct lrulist*
+listof(struct Page *p)
+{
+  return (p->flags & PG_active) ? &lru.active : &lru.inactive;
+}
+
+// Put the user page p, about to be mapped, on the active list.
+void
+lru_add(struct Page *p)
+{
+  acquire(&lru.lock);
+  if(!(p->flags & PG_lru)){
+    p->flags |= PG_lru | PG_active;
+    lrulink(&lru.active, p);
+  }
+  release(&lru.lock);
+}
+
+// Take p, which is about to be freed, off its list.
+void
+lru_del(struct Page *p)
+{
+  acquire(&lru.lock);
+  if(p->flags & PG_lru){
+    lruunlink(listof(p), p);
+    p->flags &= ~(PG_lru | PG_active);
+  }
+  release(&lru.lock);
+}
+
+// Let new, a copy of old, take old's place on the lists.
+void
+lru_replace(struct Page *old, struct Page *new)
+{
+  acquire(&lru.lock);
+  if(old->flags & PG_lru){
+    new->flags |= old->flags & (PG_lru | PG_active);
+    lruunlink(listof(old), old);
+    old->flags &= ~(PG_lru | PG_active);
+    lrulink(listof(new), new);
+  }
+  release(&lru.lock);
+}
+
+// Age up to n pages from the old end of the active list.
+static void
+shrink_active(int n)
+{
+  struct Page *p;
+
+  acquire(&lru.lock);
+  while(n-- > 0 && (p = lru.active.tail) != 0){
+    lruunlink(&lru.active, p);
+    kswap.scanned++;
+    if(page_referenced(p)){
+      lrulink(&lru.active, p);
+    } else {
+      p->flags &= ~PG_active;
+      lrulink(&lru.inactive, p);
+      kswap.deactivated++;
+    }
+  }
+  release(&lru.lock);
+}
+
+// Swap out one page from the old end of the inactive list.
+// Returns 1 if a page went, 0 if the page looked at stays,
+// or -1 if there is nothing to do.
+static int
+shrink_one(void)
+{
+  struct unmapping u;
+  struct Page *p;
+  int slot;
+
+  if((slot = swap_alloc()) < 0)
+    return -1;
+  acquire(&lru.lock);
+  if((p = lru.inactive.tail) == 0){
+    release(&lru.lock);
+    swap_cancel(slot);
+    return -1;
+  }
+  lruunlink(&lru.inactive, p);
+  kswap.scanned++;
+  if(page_referenced(p)){
+    p->flags |= PG_active;
+    lrulink(&lru.active, p);
+    release(&lru.lock);
+    swap_cancel(slot);
+    return 0;
+  }
+  pushcli();
+  if(IsPageMapped(p) != 1 || unmap_begin(p, &u) < 0){
+    // Shared, or on its way in or out of an address space.
+    lrulink(&lru.inactive, p);
+    release(&lru.lock);
+    popcli();
+    swap_cancel(slot);
+    return 0;
+  }
+  p->flags &= ~PG_lru;
+  release(&lru.lock);
+
+  unmap_flush(&u);
+  swap_cache(slot, p);
+  if(unmap_finish(&u, 0, SWPENTRY(slot)) < 0){
+    // unmap_finish put p back on the active list.
+    popcli();
+    swap_cancel(slot);
+    return 0;
+  }
+  popcli();
+  swap_writepage(slot, p);
+  kswap.reclaimed++;
+  return 1;
+}
+
+// Try to free n pages by swapping out the least recently
+// used ones.  Returns the number freed.  Sleeps for the disk,
+// so the caller must not hold a spin lock.
+int
+reclaim(int n)
+{
+  int freed, r, scan;
+
+  freed = 0;
+  for(scan = 0; freed < n && scan < 4*n; scan++){
+    // Keep the inactive list at a third of the pages or so.
+    if(lru.inactive.n < lru.active.n / 2)
+      shrink_active(SWAP_CLUSTER);
+    if((r = shrink_one()) < 0)
+      break;
+    freed += r;
+  }
+  return freed;
+}
+
+// Wake kswapd if free memory is short.  Called by kalloc.
+void
+wakeup_kswapd(void)
+{
+  if(!kswap.sleeping || buddy_nr_free() >= kswap.low)
+    return;
+  acquire(&kswap.lock);
+  if(kswap.sleeping){
+    kswap.sleeping = 0;
+    kswap.wakeups++;
+    release(&kswap.lock);
+    wakeup(&kswap);
+    return;
+  }
+  release(&kswap.lock);
+}
+
+static void
+kswapd(void)
+{
+  acquire(&kswap.lock);
+  for(;;){
+    if(buddy_nr_free() >= kswap.low){
+      kswap.sleeping = 1;
+      sleep(&kswap, &kswap.lock);
+      continue;
+    }
+    release(&kswap.lock);
+    while(buddy_nr_free() < kswap.high)
+      if(reclaim(SWAP_CLUSTER) == 0)
+        break;
+    acquire(&kswap.lock);
+    if(buddy_nr_free() < kswap.low){
+      // Nothing left to reclaim: wait to be woken again.
+      kswap.sleeping = 1;
+      sleep(&kswap, &kswap.lock);
+    }
+  }
+}
+
+// Set up the lists, and the watermarks from the memory free now.
+void
+lru_init(void)
+{
+  uint free;
+
+  initlock(&lru.lock, "lru");
+  initlock(&kswap.lock, "kswapd");
+  free = buddy_nr_free();
+  kswap.low = free / 32 > 16 ? free / 32 : 16;
+  kswap.high = 2 * kswap.low;
+}
+
+// Start kswapd.
+void
+kswapinit(void)
+{
+  kthread("kswapd", kswapd);
+}
+
+void
+vmscandump(void)
+{
+  cprintf("lru: %d active, %d inactive; kswapd: free %d, low %d, high %d, "
+          "%d wakeups, %d scanned, %d deactivated, %d reclaimed\n",
+          lru.active.n, lru.inactive.n, buddy_nr_free(), kswap.low, kswap.high,
+          kswap.wakeups, kswap.scanned, kswap.deactivated, kswap.reclaimed);
+}
@@ -84,6 +84,44 @@ lcr3(uint val)
   asm volatile("movl %0, %%cr3" : : "r" (val));
 }
 
+static inline void
+invlpg(void *addr)
+{
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
+static inline uint
+rcr4(void)
+{
+  uint val;
+  asm volatile("movl %%cr4, %0" : "=r" (val));
+  return val;
+}
+
+static inline void
+lcr4(uint val)
+{
+  asm volatile("movl %0, %%cr4" : : "r" (val));
+}
+
+static inline void
+cpuid(uint info, uint *eaxp, uint *ebxp, uint *ecxp, uint *edxp)
+{
+  uint eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" :
+               "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+               "a" (info));
+  if(eaxp)
+    *eaxp = eax;
+  if(ebxp)
+    *ebxp = ebx;
+  if(ecxp)
+    *ecxp = ecx;
+  if(edxp)
+    *edxp = edx;
+}
+
 struct segdesc;
 
 static inline void
@@ -112,6 +150,12 @@ lidt(struct gatedesc *p, int size)
   asm volatile("lidt (%0)" : : "r" (pd));
 }
 
+static inline void
+loadgs(ushort v)
+{
+  asm volatile("movw %0, %%gs" : : "r" (v));
+}
+
 static inline void
 ltr(ushort sel)
 {
@@ -145,6 +189,63 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Atomically: if *addr == old, set *addr = newval.
+// Returns the value *addr had before.
+static inline uint
+cmpxchg(volatile uint *addr, uint old, uint newval)
+{
+  uint result;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (result), "+m" (*addr) :
+               "r" (newval), "0" (old) :
+               "cc");
+  return result;
+}
+
+// Atomically add n to *addr and return its old value.
+static inline uint
+xadd(volatile uint *addr, uint n)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (n), "+m" (*addr) :
+               :
+               "cc");
+  return n;
+}
+
+// Compiler barrier: keeps gcc from moving memory accesses
+// across the point where a lock is taken or handed on.
+static inline void
+barrier(void)
+{
+  asm volatile("" : : : "memory");
+}
+
+// Full memory barrier: x86 lets a load pass an earlier store
+// to another address; this keeps every access in order.
+static inline void
+mfence(void)
+{
+  asm volatile("mfence" : : : "memory");
+}
+
+// Spin-wait hint: lets the other hyperthread run and avoids
+// a memory-order mis-speculation when the spin loop exits.
+static inline void
+pause(void)
+{
+  asm volatile("pause");
+}
+
+static inline unsigned long long
+rdtsc(void)
+{
+  unsigned long long val;
+  asm volatile("rdtsc" : "=A" (val));
+  return val;
+}
+
 static inline void
 cli(void)
 {
@@ -171,6 +272,8 @@ struct trapframe {
   uint eax;
 
   // rest of trap frame
+  ushort gs;
+  ushort padding0;
   ushort es;
   ushort padding1;
   ushort ds;